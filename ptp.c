@@ -6,6 +6,8 @@
  * it under the terms of the GNU General Public License version 3 as
  * published by the Free Software Foundation.
  */
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -15,10 +17,12 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <time.h>
-#include <semaphore.h>
 #include <iconv.h>
 #include <dirent.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <setjmp.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -28,6 +32,11 @@
 #include <sys/vfs.h>
 #include <sys/wait.h>
 #include <sys/utsname.h>
+#include <sys/uio.h>
+#include <sys/sysmacros.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/file.h>
 
 #include <asm/byteorder.h>
 
@@ -35,9 +44,15 @@
 #include <linux/usb/gadgetfs.h>
 #include <linux/usb/ch9.h>
 
+#ifndef NO_LIBJPEG
+#include <jpeglib.h>
+#endif
+
 #include "usbstring.h"
+#include "uring.h"
 
 #define min(a,b) ({ typeof(a) __a = (a); typeof(b) __b = (b); __a < __b ? __a : __b; })
+#define max(a,b) ({ typeof(a) __a = (a); typeof(b) __b = (b); __a > __b ? __a : __b; })
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
 static int verbose;
@@ -124,6 +139,7 @@ static struct usb_interface_descriptor source_sink_intf = {
 
 #define MAX_PACKET_SIZE_FS 64
 #define MAX_PACKET_SIZE_HS 512
+#define MAX_PACKET_SIZE_SS 1024
 
 /* Full speed configurations are used for full-speed only devices as
  * well as dual-speed ones (the only kind with high speed support).
@@ -147,8 +163,9 @@ static struct usb_endpoint_descriptor fs_sink_desc = {
 	.wMaxPacketSize =	__constant_cpu_to_le16(MAX_PACKET_SIZE_FS),
 };
 
-/* some devices can handle other status packet sizes */
-#define STATUS_MAXPACKET	8
+/* some devices can handle other status packet sizes, 64 bytes let any
+ * event container go out in a single (short) packet */
+#define STATUS_MAXPACKET	64
 //#define	LOG2_STATUS_POLL_MSEC	3
 
 static struct usb_endpoint_descriptor fs_status_desc = {
@@ -232,11 +249,6 @@ static int	HIGHSPEED;
 static char	*DEVNAME;
 static char	*EP_IN_NAME, *EP_OUT_NAME, *EP_STATUS_NAME;
 
-/* gadgetfs currently has no chunking (or O_DIRECT/zerocopy) support
- * to turn big requests into lots of smaller ones; so this is "small".
- */
-#define	USB_BUFSIZE	(7 * 1024)
-
 static enum usb_device_speed current_speed;
 
 #define CHECK_COUNT(cnt, min, max, op) do {			\
@@ -308,10 +320,51 @@ enum pima15740_operation_code {
 	PIMA15740_OP_SET_DEVICE_PROP_VALUE	= 0x1016,
 	PIMA15740_OP_RESET_DEVICE_PROP_VALUE	= 0x1017,
 	PIMA15740_OP_TERMINATE_OPEN_CAPTURE	= 0x1018,
-	PIMA15740_OP_MOVE_OBJECT		= 0x1009,
-	PIMA15740_OP_COPY_OBJECT		= 0x100a,
-	PIMA15740_OP_GET_PARTIAL_OBJECT		= 0x100b,
-	PIMA15740_OP_INITIATE_OPEN_CAPTURE	= 0x100c,
+	PIMA15740_OP_MOVE_OBJECT		= 0x1019,
+	PIMA15740_OP_COPY_OBJECT		= 0x101a,
+	PIMA15740_OP_GET_PARTIAL_OBJECT		= 0x101b,
+	PIMA15740_OP_INITIATE_OPEN_CAPTURE	= 0x101c,
+};
+
+/* Vendor-extension operations, not part of PIMA 15740 */
+enum ptp_vendor_operation_code {
+	PTP_VENDOR_OP_DELETE_OBJECT_LIST	= 0x9101,
+};
+
+/* MTP vendor extension, vendor extension ID 6 */
+#define MTP_VENDOR_EXT_ID	6
+
+enum mtp_operation_code {
+	MTP_OP_GET_OBJECT_PROPS_SUPPORTED	= 0x9801,
+	MTP_OP_GET_OBJECT_PROP_DESC		= 0x9802,
+	MTP_OP_GET_OBJECT_PROP_VALUE		= 0x9803,
+	MTP_OP_GET_OBJECT_PROP_LIST		= 0x9805,
+};
+
+enum mtp_response_code {
+	MTP_RESP_INVALID_OBJECT_PROP_CODE		= 0xa801,
+	MTP_RESP_SPECIFICATION_BY_GROUP_UNSUPPORTED	= 0xa807,
+	MTP_RESP_SPECIFICATION_BY_DEPTH_UNSUPPORTED	= 0xa808,
+	MTP_RESP_OBJECT_PROP_NOT_SUPPORTED		= 0xa80a,
+};
+
+enum mtp_object_property {
+	MTP_PROP_STORAGE_ID			= 0xdc01,
+	MTP_PROP_OBJECT_FORMAT			= 0xdc02,
+	MTP_PROP_PROTECTION_STATUS		= 0xdc03,
+	MTP_PROP_OBJECT_SIZE			= 0xdc04,
+	MTP_PROP_OBJECT_FILE_NAME		= 0xdc07,
+	MTP_PROP_DATE_CREATED			= 0xdc08,
+	MTP_PROP_DATE_MODIFIED			= 0xdc09,
+	MTP_PROP_PARENT_OBJECT			= 0xdc0b,
+	MTP_PROP_NAME				= 0xdc44,
+};
+
+enum ptp_data_type {
+	PTP_TYPE_UINT16				= 0x0004,
+	PTP_TYPE_UINT32				= 0x0006,
+	PTP_TYPE_UINT64				= 0x0008,
+	PTP_TYPE_STR				= 0xffff,
 };
 
 enum pima15740_response_code {
@@ -362,6 +415,24 @@ enum pima15740_data_format {
 	PIMA15740_FMT_I_TIFF_IT			= 0x380e,
 };
 
+enum pima15740_event_code {
+	PIMA15740_EVENT_UNDEFINED		= 0x4000,
+	PIMA15740_EVENT_CANCEL_TRANSACTION	= 0x4001,
+	PIMA15740_EVENT_OBJECT_ADDED		= 0x4002,
+	PIMA15740_EVENT_OBJECT_REMOVED		= 0x4003,
+	PIMA15740_EVENT_STORE_ADDED		= 0x4004,
+	PIMA15740_EVENT_STORE_REMOVED		= 0x4005,
+	PIMA15740_EVENT_DEVICE_PROP_CHANGED	= 0x4006,
+	PIMA15740_EVENT_OBJECT_INFO_CHANGED	= 0x4007,
+	PIMA15740_EVENT_DEVICE_INFO_CHANGED	= 0x4008,
+	PIMA15740_EVENT_REQUEST_OBJECT_TRANSFER	= 0x4009,
+	PIMA15740_EVENT_STORE_FULL		= 0x400a,
+	PIMA15740_EVENT_DEVICE_RESET		= 0x400b,
+	PIMA15740_EVENT_STORAGE_INFO_CHANGED	= 0x400c,
+	PIMA15740_EVENT_CAPTURE_COMPLETE	= 0x400d,
+	PIMA15740_EVENT_UNREPORTED_STATUS	= 0x400e,
+};
+
 enum pima15740_storage_type {
 	PIMA15740_STORAGE_UNDEFINED		= 0,
 	PIMA15740_STORAGE_FIXED_ROM		= 0x0001,
@@ -386,6 +457,7 @@ enum pima15740_access_capability {
 static const char manuf[] = PTP_MANUFACTURER;
 static const char model[] = PTP_MODEL;
 static const char storage_desc[] = PTP_STORAGE_DESC;
+static const char vendor_ext_desc[] = "microsoft.com: 1.0; ";
 
 #define SUPPORTED_OPERATIONS					\
 	__constant_cpu_to_le16(PIMA15740_OP_GET_DEVICE_INFO),	\
@@ -398,7 +470,14 @@ static const char storage_desc[] = PTP_STORAGE_DESC;
 	__constant_cpu_to_le16(PIMA15740_OP_GET_OBJECT_INFO),	\
 	__constant_cpu_to_le16(PIMA15740_OP_GET_OBJECT),	\
 	__constant_cpu_to_le16(PIMA15740_OP_GET_THUMB),		\
-	__constant_cpu_to_le16(PIMA15740_OP_DELETE_OBJECT),
+	__constant_cpu_to_le16(PIMA15740_OP_DELETE_OBJECT),	\
+	__constant_cpu_to_le16(PIMA15740_OP_GET_PARTIAL_OBJECT),\
+	__constant_cpu_to_le16(PTP_VENDOR_OP_DELETE_OBJECT_LIST),	\
+	__constant_cpu_to_le16(MTP_OP_GET_OBJECT_PROPS_SUPPORTED),	\
+	__constant_cpu_to_le16(MTP_OP_GET_OBJECT_PROP_DESC),	\
+	__constant_cpu_to_le16(MTP_OP_GET_OBJECT_PROP_VALUE),	\
+	__constant_cpu_to_le16(MTP_OP_GET_OBJECT_PROP_LIST),	\
+	__constant_cpu_to_le16(PIMA15740_OP_INITIATE_CAPTURE),
 
 static uint16_t dummy_supported_operations[] = {
 	SUPPORTED_OPERATIONS
@@ -416,17 +495,32 @@ static uint16_t dummy_supported_formats[] = {
 	SUPPORTED_FORMATS
 };
 
+#define SUPPORTED_EVENTS						\
+	__constant_cpu_to_le16(PIMA15740_EVENT_OBJECT_ADDED),		\
+	__constant_cpu_to_le16(PIMA15740_EVENT_OBJECT_REMOVED),		\
+	__constant_cpu_to_le16(PIMA15740_EVENT_STORE_FULL),		\
+	__constant_cpu_to_le16(PIMA15740_EVENT_STORAGE_INFO_CHANGED),	\
+	__constant_cpu_to_le16(PIMA15740_EVENT_UNREPORTED_STATUS),	\
+	__constant_cpu_to_le16(PIMA15740_EVENT_CAPTURE_COMPLETE),
+
+static uint16_t dummy_supported_events[] = {
+	SUPPORTED_EVENTS
+};
+
 struct my_device_info {
 	uint16_t	std_ver;
 	uint32_t	vendor_ext_id;
 	uint16_t	vendor_ext_ver;
 	uint8_t		vendor_ext_desc_len;
+	uint8_t		vendor_ext_desc[sizeof(vendor_ext_desc) * 2];
 	uint16_t	func_mode;
 	uint32_t	operations_n;
 	uint16_t	operations[ARRAY_SIZE(dummy_supported_operations)];
 	uint32_t	events_n;
+	uint16_t	events[ARRAY_SIZE(dummy_supported_events)];
 	uint32_t	device_properties_n;
 	uint32_t	capture_formats_n;
+	uint16_t	capture_formats[1];
 	uint32_t	image_formats_n;
 	uint16_t	image_formats[ARRAY_SIZE(dummy_supported_formats)];
 	uint8_t		manuf_len;
@@ -439,17 +533,23 @@ struct my_device_info {
 
 struct my_device_info dev_info = {
 	.std_ver		= __constant_cpu_to_le16(100),	/* Standard version 1.00 */
-	.vendor_ext_id		= __constant_cpu_to_le32(0),
-	.vendor_ext_ver		= __constant_cpu_to_le16(0),
-	.vendor_ext_desc_len	= __constant_cpu_to_le16(0),
+	.vendor_ext_id		= __constant_cpu_to_le32(MTP_VENDOR_EXT_ID),
+	.vendor_ext_ver		= __constant_cpu_to_le16(100),
+	.vendor_ext_desc_len	= sizeof(vendor_ext_desc),
 	.func_mode		= __constant_cpu_to_le16(0),
 	.operations_n		= __constant_cpu_to_le32(ARRAY_SIZE(dummy_supported_operations)),
 	.operations = {
 		SUPPORTED_OPERATIONS
 	},
-	.events_n		= __constant_cpu_to_le32(0),
+	.events_n		= __constant_cpu_to_le32(ARRAY_SIZE(dummy_supported_events)),
+	.events = {
+		SUPPORTED_EVENTS
+	},
 	.device_properties_n	= __constant_cpu_to_le32(0),
-	.capture_formats_n	= __constant_cpu_to_le32(0),
+	.capture_formats_n	= __constant_cpu_to_le32(1),
+	.capture_formats = {
+		__constant_cpu_to_le16(PIMA15740_FMT_I_EXIF_JPEG),
+	},
 	.image_formats_n	= __constant_cpu_to_le32(ARRAY_SIZE(dummy_supported_formats)),
 	.image_formats = {
 		SUPPORTED_FORMATS
@@ -472,6 +572,28 @@ struct my_storage_info {
 	uint8_t		volume_label_len;
 } __attribute__ ((packed));
 
+static const char ram_storage_desc[] = "Captures";
+
+struct my_ram_storage_info {
+	uint16_t	storage_type;
+	uint16_t	filesystem_type;
+	uint16_t	access_capability;
+	uint64_t	max_capacity;
+	uint64_t	free_space_in_bytes;
+	uint32_t	free_space_in_images;
+	uint8_t		desc_len;
+	uint8_t		desc[sizeof(ram_storage_desc) * 2];
+	uint8_t		volume_label_len;
+} __attribute__ ((packed));
+
+static struct my_ram_storage_info ram_storage_info = {
+	.storage_type		= __constant_cpu_to_le16(PIMA15740_STORAGE_FIXED_RAM),
+	.filesystem_type	= __constant_cpu_to_le16(PIMA15740_FILESYSTEM_GENERIC_FLAT),
+	.access_capability	= __constant_cpu_to_le16(PIMA15740_ACCESS_CAP_RO_WITH_DEL),
+	.desc_len		= sizeof(ram_storage_desc),
+	.volume_label_len	= 0,
+};
+
 static struct my_storage_info storage_info = {
 	.storage_type		= __constant_cpu_to_le16(PIMA15740_STORAGE_REMOVABLE_RAM),
 	.filesystem_type	= __constant_cpu_to_le16(PIMA15740_FILESYSTEM_DCF),
@@ -487,10 +609,11 @@ static int bulk_out = -ENXIO;
 static int control = -ENXIO;
 static int interrupt = -ENXIO;
 static int session = -EINVAL;
-static sem_t reset;
 
 static iconv_t ic;
 static char *root;
+/* Objects and thumbnails are accessed relative to these directories */
+static int root_fd = -1, thumb_fd = -1;
 
 #define	NEVENT		5
 
@@ -514,6 +637,296 @@ static pthread_t bulk_pthread;
 #define THUMB_HEIGHT	120
 #define THUMB_SIZE	__stringify(THUMB_WIDTH) "x" __stringify(THUMB_HEIGHT)
 
+/* io_uring is used for scanning and for the data path, unless disabled by -U */
+#define URING_CHUNK	(64 * 1024)
+#define URING_BUFS	2
+
+static int use_uring = 1;
+static struct uring data_ring = { .fd = -1 };
+static void *uring_buf[URING_BUFS];
+
+/*
+ * Transfer buffers: XFER_BUFS page aligned buffers, all in one mapping, in a
+ * huge page if there is one to be had, and locked, so that sending data
+ * neither allocates nor faults. A buffer belongs to whoever has taken it with
+ * xfer_get(), until it is handed back with xfer_put(). The size leaves room
+ * for a URING_CHUNK and a container header, and is a multiple of the maximum
+ * packet size.
+ */
+#define XFER_BUF_SIZE	(128 * 1024)
+#define XFER_BUFS	16
+
+static void *xfer_free[XFER_BUFS];
+static int xfer_nfree;
+static pthread_mutex_t xfer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int xfer_init(void)
+{
+	size_t size = XFER_BUF_SIZE * XFER_BUFS;
+	void *pool;
+	int i;
+
+	pool = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (pool == MAP_FAILED)
+		pool = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (pool == MAP_FAILED) {
+		perror("transfer buffers");
+		return -1;
+	}
+
+	/* Only costs page faults, if RLIMIT_MEMLOCK is too small */
+	if (mlock(pool, size) < 0 && verbose)
+		fprintf(stderr, "Cannot lock transfer buffers: %s\n", strerror(errno));
+
+	for (i = 0; i < XFER_BUFS; i++)
+		xfer_free[xfer_nfree++] = pool + i * XFER_BUF_SIZE;
+
+	return 0;
+}
+
+/* Returns NULL if all buffers are taken */
+static void *xfer_get(void)
+{
+	void *buf = NULL;
+
+	pthread_mutex_lock(&xfer_lock);
+	if (xfer_nfree)
+		buf = xfer_free[--xfer_nfree];
+	pthread_mutex_unlock(&xfer_lock);
+
+	return buf;
+}
+
+/* Also a cleanup handler for cancelled threads, NULL is ignored */
+static void xfer_put(void *buf)
+{
+	if (!buf)
+		return;
+
+	pthread_mutex_lock(&xfer_lock);
+	xfer_free[xfer_nfree++] = buf;
+	pthread_mutex_unlock(&xfer_lock);
+}
+
+static uint64_t ts_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+/*
+ * Startup profiler, enabled by -p: the phases of startup are timed with the
+ * monotonic clock and the costs of every image during the scan collected in
+ * log2 histograms, which also keep the slowest images. The report is printed
+ * when the host configures the device, or before a replay, and profiling ends
+ * there. stat() is only timed per image without io_uring, with io_uring the
+ * whole batch is one phase.
+ */
+enum prof_phase {
+	PROF_ICONV,
+	PROF_DIRS,
+	PROF_PACK_OPEN,
+	PROF_HANDLES_LOAD,
+	PROF_SCAN,
+	PROF_SCAN_LIST,
+	PROF_SCAN_STATX,
+	PROF_SCAN_THUMBS,
+	PROF_SCAN_OBJECTS,
+	PROF_SCAN_COMPACT,
+	PROF_SCAN_HANDLES,
+	PROF_PACK_SHARE,
+	PROF_XFER,
+	PROF_DATA_RING,
+	PROF_THREADS,
+	PROF_STORAGE,
+	PROF_DEVICE,
+	PROF_AUTOCONFIG,
+	PROF_DESCRIPTORS,
+	PROF_CONFIG_WAIT,
+	PROF_START_IO,
+	PROF_PHASES,
+};
+
+enum prof_file {
+	PROF_FILE_STAT,
+	PROF_FILE_HASH,
+	PROF_FILE_THUMB_STAT,
+	PROF_FILE_JPEG,
+	PROF_FILE_CONVERT,
+	PROF_FILE_PACK,
+	PROF_FILE_INFO,
+	PROF_FILE_TOTAL,
+	PROF_FILES,
+};
+
+/* Bucket i counts costs below 2^(i + 1) microseconds, the last one the rest */
+#define PROF_BUCKETS	24
+#define PROF_SLOWEST	5
+#define PROF_BAR	40
+
+static const struct {
+	const char	*name;
+	int		depth;
+} prof_phase_names[PROF_PHASES] = {
+	[PROF_ICONV]		= { "iconv strings",		0 },
+	[PROF_DIRS]		= { "open directories",		0 },
+	[PROF_PACK_OPEN]	= { "thumbnail pack",		0 },
+	[PROF_HANDLES_LOAD]	= { "load handles",		0 },
+	[PROF_SCAN]		= { "scan",			0 },
+	[PROF_SCAN_LIST]	= { "read directory",		1 },
+	[PROF_SCAN_STATX]	= { "io_uring statx",		1 },
+	[PROF_SCAN_THUMBS]	= { "stat, thumbnails",		1 },
+	[PROF_SCAN_OBJECTS]	= { "objects",			1 },
+	[PROF_SCAN_COMPACT]	= { "pack compaction",		1 },
+	[PROF_SCAN_HANDLES]	= { "save handles",		1 },
+	[PROF_PACK_SHARE]	= { "share pack",		0 },
+	[PROF_XFER]		= { "transfer buffers",		0 },
+	[PROF_DATA_RING]	= { "io_uring data ring",	0 },
+	[PROF_THREADS]		= { "worker threads",		0 },
+	[PROF_STORAGE]		= { "storage info",		0 },
+	[PROF_DEVICE]		= { "device",			0 },
+	[PROF_AUTOCONFIG]	= { "autoconfig",		1 },
+	[PROF_DESCRIPTORS]	= { "descriptors",		1 },
+	[PROF_CONFIG_WAIT]	= { "wait for SET_CONFIGURATION", 0 },
+	[PROF_START_IO]		= { "endpoints",		0 },
+};
+
+static const char * const prof_file_names[PROF_FILES] = {
+	[PROF_FILE_STAT]	= "stat",
+	[PROF_FILE_HASH]	= "content hash",
+	[PROF_FILE_THUMB_STAT]	= "thumbnail stat",
+	[PROF_FILE_JPEG]	= "libjpeg",
+	[PROF_FILE_CONVERT]	= "convert",
+	[PROF_FILE_PACK]	= "pack append",
+	[PROF_FILE_INFO]	= "object info",
+	[PROF_FILE_TOTAL]	= "total",
+};
+
+struct prof_hist {
+	unsigned long	count;
+	uint64_t	ns, max_ns;
+	unsigned long	bucket[PROF_BUCKETS];
+	struct {
+		uint64_t	ns;
+		char		name[NAME_MAX + 1];
+	} slowest[PROF_SLOWEST];
+};
+
+static int profile;
+static uint64_t prof_start, prof_config_start;
+static struct {
+	uint64_t	ns;
+	unsigned long	count;
+} prof_phases[PROF_PHASES];
+static struct prof_hist prof_files[PROF_FILES];
+/* Images are timed by the scan threads too */
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t prof_now(void)
+{
+	struct timespec ts;
+
+	if (!profile)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts_ns(&ts);
+}
+
+/* Phases are timed by the main thread only */
+static void prof_phase(enum prof_phase p, uint64_t t0)
+{
+	if (!profile)
+		return;
+
+	prof_phases[p].ns += prof_now() - t0;
+	prof_phases[p].count++;
+}
+
+/* Returns the time since t0, 0 if not profiling */
+static uint64_t prof_file(enum prof_file k, const char *name, uint64_t t0)
+{
+	struct prof_hist *h = prof_files + k;
+	uint64_t ns, us;
+	int i;
+
+	if (!profile)
+		return 0;
+
+	ns = prof_now() - t0;
+	for (i = 0, us = ns / 1000; us > 1 && i < PROF_BUCKETS - 1; us >>= 1)
+		i++;
+
+	pthread_mutex_lock(&prof_lock);
+	h->count++;
+	h->ns += ns;
+	h->max_ns = max(h->max_ns, ns);
+	h->bucket[i]++;
+	for (i = PROF_SLOWEST; i > 0 && h->slowest[i - 1].ns < ns; i--)
+		if (i < PROF_SLOWEST)
+			h->slowest[i] = h->slowest[i - 1];
+	if (i < PROF_SLOWEST) {
+		h->slowest[i].ns = ns;
+		strncpy(h->slowest[i].name, name, sizeof(h->slowest[i].name) - 1);
+	}
+	pthread_mutex_unlock(&prof_lock);
+
+	return ns;
+}
+
+static void prof_hist_report(const char *name, const struct prof_hist *h)
+{
+	unsigned long peak = 0;
+	int i, first = -1, last = 0;
+
+	printf("%-16s %8lu %12.3f %10.1f %10.1f\n", name, h->count, h->ns / 1e6,
+	       h->ns / 1e3 / h->count, h->max_ns / 1e3);
+
+	for (i = 0; i < PROF_BUCKETS; i++) {
+		if (!h->bucket[i])
+			continue;
+		if (first < 0)
+			first = i;
+		last = i;
+		peak = max(peak, h->bucket[i]);
+	}
+	for (i = first; i <= last; i++)
+		printf("  %s %8lu us %8lu%.*s\n", i < PROF_BUCKETS - 1 ? "< " : ">=",
+		       1UL << (i < PROF_BUCKETS - 1 ? i + 1 : i), h->bucket[i],
+		       (int)((h->bucket[i] * PROF_BAR + peak - 1) / peak + !!h->bucket[i]),
+		       " ########################################");
+
+	for (i = 0; i < PROF_SLOWEST && h->slowest[i].ns; i++)
+		printf("  %s %10.1f us %s\n", i ? "       " : "slowest",
+		       h->slowest[i].ns / 1e3, h->slowest[i].name);
+}
+
+static void prof_report(int objects)
+{
+	int i;
+
+	printf("startup profile, %d objects\n", objects);
+	printf("%-30s %8s %12s\n", "phase", "count", "ms");
+	for (i = 0; i < PROF_PHASES; i++) {
+		if (!prof_phases[i].count)
+			continue;
+		printf("%*s%-*s %8lu %12.3f\n", 2 * prof_phase_names[i].depth, "",
+		       30 - 2 * prof_phase_names[i].depth, prof_phase_names[i].name,
+		       prof_phases[i].count, prof_phases[i].ns / 1e6);
+	}
+	printf("%-30s %8s %12.3f\n", "total", "", (prof_now() - prof_start) / 1e6);
+
+	printf("%-16s %8s %12s %10s %10s\n", "per image", "count", "ms",
+	       "mean us", "max us");
+	for (i = 0; i < PROF_FILES; i++)
+		if (prof_files[i].count)
+			prof_hist_report(prof_file_names[i], prof_files + i);
+
+	fflush(stdout);
+	profile = 0;
+}
+
 struct ptp_object_info {
 	uint32_t	storage_id;
 	uint16_t	object_format;
@@ -556,6 +969,10 @@ struct obj_list {
 	uint32_t		handle;
 	size_t			info_size;
 	char			name[256];
+	uint64_t		size;		/* object_compressed_size saturates at 4GiB */
+	uint64_t		thumb_hash;	/* in the thumbnail pack, 0 if none */
+	int			mem_fd;		/* captured into RAM, -1 for files */
+	unsigned long		used;		/* RAM objects: last read, for eviction */
 	struct ptp_object_info	info;
 };
 
@@ -563,6 +980,20 @@ static struct obj_list *images;
 /* number of objects, including associations - decrement when deleting */
 static int object_number;
 
+/*
+ * RAM store: with a capture source, captured objects live in a second store
+ * of their own, in the root, limited to ram_store_budget bytes and, unless 0,
+ * ram_store_max objects. The least recently read objects are evicted to make
+ * room for a new capture. Only the bulk thread touches the store.
+ */
+#define RAM_STORE_ID		0x00020001
+#define RAM_STORE_BUDGET	(64 * 1024 * 1024)
+
+static const char *capture_source;
+static uint64_t ram_store_budget = RAM_STORE_BUDGET, ram_store_bytes;
+static unsigned int ram_store_max, ram_store_count;
+static unsigned long ram_store_clock;
+
 static size_t put_string(iconv_t ic, char *buf, const char *s, size_t len);
 
 static int object_handle_valid(unsigned int h)
@@ -580,6 +1011,183 @@ static int object_handle_valid(unsigned int h)
 	return 0;
 }
 
+static int store_valid(uint32_t store)
+{
+	return store == STORE_ID || (capture_source && store == RAM_STORE_ID);
+}
+
+/*
+ * GetNumObjects and GetObjectHandles select objects by store, PTP_PARAM_ANY
+ * for all stores, and by parent: 0 for all objects, PTP_PARAM_ANY for those
+ * in the root, or an association. object_filter_next() walks the selection,
+ * the two associations first, then the images, and returns 0 at its end.
+ */
+struct object_filter {
+	uint32_t	store;
+	uint32_t	parent;
+	uint32_t	association;	/* last one walked */
+	struct obj_list	**next;
+};
+
+static enum pima15740_response_code object_filter_init(struct object_filter *f,
+							uint32_t store, uint32_t parent)
+{
+	if (store != PTP_PARAM_ANY && !store_valid(store))
+		return PIMA15740_RESP_INVALID_STORAGE_ID;
+
+	if (parent != PTP_PARAM_UNUSED && parent != PTP_PARAM_ANY) {
+		if (!object_handle_valid(parent))
+			return PIMA15740_RESP_INVALID_OBJECT_HANDLE;
+		/* Only /DCIM and /DCIM/PTP_MODEL_DIR are associations */
+		if (parent != 1 && parent != 2)
+			return PIMA15740_RESP_INVALID_PARENT_OBJECT;
+	}
+
+	f->store	= store;
+	f->parent	= parent;
+	f->association	= 0;
+	f->next		= &images;
+
+	return PIMA15740_RESP_OK;
+}
+
+static int object_filter_match(const struct object_filter *f, uint32_t store, uint32_t parent)
+{
+	if (f->store != PTP_PARAM_ANY && f->store != store)
+		return 0;
+
+	switch (f->parent) {
+	case PTP_PARAM_UNUSED:
+		return 1;
+	case PTP_PARAM_ANY:
+		return !parent;
+	default:
+		return parent == f->parent;
+	}
+}
+
+static uint32_t object_filter_next(struct object_filter *f)
+{
+	struct obj_list *obj;
+
+	/* /DCIM is in the root, /DCIM/PTP_MODEL_DIR in /DCIM */
+	while (f->association < 2)
+		if (object_filter_match(f, STORE_ID, f->association++))
+			return f->association;
+
+	while ((obj = *f->next)) {
+		f->next = &obj->next;
+		if (object_filter_match(f, __le32_to_cpu(obj->info.storage_id),
+					__le32_to_cpu(obj->info.parent_object)))
+			return obj->handle;
+	}
+
+	return 0;
+}
+
+/*
+ * A new object in /DCIM/PTP_MODEL_DIR: fixed size object info, filename,
+ * capture date, and two empty strings. Handle and thumbnail are up to the
+ * caller, a thumb_size of 0 means there is no thumbnail.
+ */
+static struct obj_list *object_new(const char *name, time_t date, uint64_t size, int protect,
+				   enum pima15740_data_format format, int thumb_size)
+{
+	char mod[32], mod_ucs2[64], fname_ucs2[512];
+	size_t namelen, datelen;
+	struct obj_list *obj;
+	struct tm mod_tm;
+
+	namelen = strlen(name) + 1;
+
+	if (put_string(ic, fname_ucs2, name, namelen))
+		return NULL;
+
+	gmtime_r(&date, &mod_tm);
+	snprintf(mod, sizeof(mod),"%04u%02u%02uT%02u%02u%02u.0Z",
+		 mod_tm.tm_year + 1900, mod_tm.tm_mon + 1,
+		 mod_tm.tm_mday, mod_tm.tm_hour,
+		 mod_tm.tm_min, mod_tm.tm_sec);
+
+	/* String length including the trailing '\0' */
+	datelen = strlen(mod) + 1;
+	if (put_string(ic, mod_ucs2, mod, datelen)) {
+		mod[0] = '\0';
+		datelen = 0;
+	}
+
+	/* namelen and datelen include terminating '\0', plus 4 string-size bytes */
+	obj = malloc(sizeof(*obj) + 2 * (datelen + namelen) + 4);
+	if (!obj)
+		return NULL;
+
+	if (verbose)
+		fprintf(stderr, "Listing image %s, modified %s, info-size %zu\n",
+			name, mod, sizeof(obj->info) + 2 * (datelen + namelen) + 4);
+
+	obj->next	= NULL;
+	obj->handle	= 0;
+	obj->thumb_hash	= 0;
+	obj->mem_fd	= -1;
+	obj->size	= size;
+
+	obj->info_size = sizeof(obj->info) + 2 * (datelen + namelen) + 4;
+
+	obj->info.storage_id			= __cpu_to_le32(STORE_ID);
+	obj->info.object_format			= __cpu_to_le16(format);
+	obj->info.protection_status		= __cpu_to_le16(protect);
+	obj->info.object_compressed_size	= __cpu_to_le32(min(size, (uint64_t)PTP_PARAM_ANY));
+	obj->info.thumb_format			= __cpu_to_le16(thumb_size ? PIMA15740_FMT_I_JFIF : 0);
+	obj->info.thumb_compressed_size		= __cpu_to_le32(thumb_size);
+	obj->info.thumb_pix_width		= __cpu_to_le32(thumb_size ? THUMB_WIDTH : 0);
+	obj->info.thumb_pix_height		= __cpu_to_le32(thumb_size ? THUMB_HEIGHT : 0);
+	obj->info.image_pix_width		= __cpu_to_le32(0);	/* 0 == */
+	obj->info.image_pix_height		= __cpu_to_le32(0);	/* not */
+	obj->info.image_bit_depth		= __cpu_to_le32(0);	/* supported */
+	obj->info.parent_object			= __cpu_to_le32(2);	/* Fixed /dcim/xxx/ */
+	obj->info.association_type		= __cpu_to_le16(0);
+	obj->info.association_desc		= __cpu_to_le32(0);
+	obj->info.sequence_number		= __cpu_to_le32(0);
+	strncpy(obj->name, name, sizeof(obj->name));
+
+	obj->info.strings[0]				= namelen;
+	memcpy(obj->info.strings + 1, fname_ucs2, namelen * 2);
+	/* We use file modification date as Capture Date */
+	obj->info.strings[1 + namelen * 2]		= datelen;
+	memcpy(obj->info.strings + 2 + namelen * 2, mod_ucs2, datelen * 2);
+	/* Empty Modification Date */
+	obj->info.strings[2 + (namelen + datelen) * 2]	= 0;
+	/* Empty Keywords */
+	obj->info.strings[3 + (namelen + datelen) * 2]	= 0;
+
+	return obj;
+}
+
+/*
+ * The controller file in /dev/gadget, of which there is only one before the
+ * device has been configured. Newer controllers are named after their device.
+ */
+static char *find_udc(void)
+{
+	static char name[NAME_MAX + 1];
+	struct dirent *dentry;
+	DIR *d;
+
+	d = opendir(".");
+	if (!d)
+		return NULL;
+
+	name[0] = '\0';
+	while ((dentry = readdir(d)))
+		if (dentry->d_name[0] != '.') {
+			strncpy(name, dentry->d_name, sizeof(name) - 1);
+			break;
+		}
+	closedir(d);
+
+	return name[0] ? name : NULL;
+}
+
 static int autoconfig(void)
 {
 	struct stat	statb;
@@ -779,6 +1387,29 @@ static int autoconfig(void)
 			= USB_DIR_OUT | 1;
 		EP_OUT_NAME = "ep1out";
 
+		source_sink_intf.bNumEndpoints = 3;
+		fs_status_desc.bEndpointAddress
+			= hs_status_desc.bEndpointAddress
+			= USB_DIR_IN | 2;
+		EP_STATUS_NAME = "ep2in";
+
+	/*
+	 * Anything else with numbered endpoints: DesignWare dwc2 and dwc3,
+	 * Cadence cdns3, ... USB 3 controllers included, but gadgetfs only
+	 * does high speed.
+	 */
+	} else if ((DEVNAME = find_udc())) {
+		HIGHSPEED = 1;
+
+		fs_source_desc.bEndpointAddress
+			= hs_source_desc.bEndpointAddress
+			= USB_DIR_IN | 1;
+		EP_IN_NAME = "ep1in";
+		fs_sink_desc.bEndpointAddress
+			= hs_sink_desc.bEndpointAddress
+			= USB_DIR_OUT | 1;
+		EP_OUT_NAME = "ep1out";
+
 		source_sink_intf.bNumEndpoints = 3;
 		fs_status_desc.bEndpointAddress
 			= hs_status_desc.bEndpointAddress
@@ -806,7 +1437,11 @@ static int ep_config(char *name,
 		     struct usb_endpoint_descriptor *hs)
 {
 	int	fd, err;
-	char	buf[USB_BUFSIZE];
+	char	*buf;
+
+	buf = xfer_get();
+	if (!buf)
+		return -ENOMEM;
 
 	/* open and initialize with endpoint descriptor(s) */
 	fd = open(name, O_RDWR);
@@ -814,6 +1449,7 @@ static int ep_config(char *name,
 		err = -errno;
 		fprintf(stderr, "open %s error %d (%s)\n",
 			name, errno, strerror(errno));
+		xfer_put(buf);
 		return err;
 	}
 
@@ -825,6 +1461,7 @@ static int ep_config(char *name,
 			hs, USB_DT_ENDPOINT_SIZE);
 	err = write(fd, buf, 4 + USB_DT_ENDPOINT_SIZE
 			+ (HIGHSPEED ? USB_DT_ENDPOINT_SIZE : 0));
+	xfer_put(buf);
 	if (err < 0) {
 		err = -errno;
 		fprintf(stderr, "config %s error %d (%s)\n",
@@ -868,21 +1505,31 @@ static char *build_config(char *cp, const struct usb_endpoint_descriptor **ep)
 
 static void init_device(void)
 {
-	char		buf[4096], *cp = buf;
+	char		*buf, *cp;
+	uint64_t	t0;
 	int		err;
 
+	t0 = prof_now();
 	err = autoconfig();
+	prof_phase(PROF_AUTOCONFIG, t0);
 	if (err < 0) {
 		fprintf(stderr, "?? don't recognize /dev/gadget bulk device\n");
 		control = err;
 		return;
 	}
 
+	buf = cp = xfer_get();
+	if (!buf) {
+		control = -ENOMEM;
+		return;
+	}
+
+	t0 = prof_now();
 	control = open(DEVNAME, O_RDWR);
 	if (control < 0) {
 		perror(DEVNAME);
 		control = -errno;
-		return;
+		goto out;
 	}
 
 	*(uint32_t *)cp = 0;	/* tag for this format */
@@ -902,15 +1549,16 @@ static void init_device(void)
 		perror("write dev descriptors");
 		close(control);
 		control = -errno;
-		return;
 	} else if (err != cp - buf) {
 		fprintf(stderr, "dev init, wrote %d expected %d\n",
 				err, cp - buf);
 		close(control);
 		control = -errno;
-		return;
 	}
-	return;
+	prof_phase(PROF_DESCRIPTORS, t0);
+
+out:
+	xfer_put(buf);
 }
 
 static const char *speed(enum usb_device_speed s)
@@ -919,6 +1567,7 @@ static const char *speed(enum usb_device_speed s)
 	case USB_SPEED_LOW:	return "low speed";
 	case USB_SPEED_FULL:	return "full speed";
 	case USB_SPEED_HIGH:	return "high speed";
+	case USB_SPEED_SUPER:	return "super speed";
 	default:		return "UNKNOWN speed";
 	}
 }
@@ -934,1412 +1583,6220 @@ static void make_response(struct ptp_container *s_cntn, struct ptp_container *r_
 	s_cntn->length = __cpu_to_le32(len);
 }
 
-static int bulk_write(void *buf, size_t length)
-{
-	size_t count = 0;
-	int ret;
+/*
+ * ep0 talks to the bulk thread through io_request and the io_event eventfd.
+ * The bulk thread polls the eventfd together with the endpoint before every
+ * transfer, since gadgetfs endpoints cannot be polled for readiness, ep0 also
+ * kicks it out of a blocking read() or write() with SIGINT, repeating the
+ * kick until the request is acknowledged:
+ *
+ *   IO_STOPPED -> IO_IDLE	endpoints configured, waiting for a command
+ *   IO_IDLE -> IO_BUSY		command received, executing the transaction
+ *   IO_BUSY -> IO_IDLE		response sent, or transaction cancelled
+ *   any -> IO_PARKED		reset requested, waiting for ep0 to clear halts
+ *   IO_PARKED -> IO_IDLE	reset done, the current transaction is dropped
+ *
+ * A cancelled transaction is left at the next chunk boundary, terminated
+ * without a response phase and Device Status reports TRANSACTION_CANCELLED.
+ */
+enum io_state {
+	IO_STOPPED,
+	IO_IDLE,
+	IO_BUSY,
+	IO_PARKED,
+};
 
-	do {
-		ret = write(bulk_in, buf + count, length - count);
-		if (ret < 0) {
-			if (errno != EINTR)
-				return ret;
+#define IO_REQ_RESET		(1 << 0)
+#define IO_REQ_CANCEL		(1 << 1)
+/* A reset, which the bulk thread has not parked for in time */
+#define IO_REQ_FLUSH		(1 << 2)
+
+/* ep0 waits this long for the bulk thread, kicking it every IO_KICK_MS */
+#define IO_ACK_MS		100
+#define IO_KICK_MS		5
+
+/* Only accessed with io_lock held */
+static enum io_state io_state = IO_STOPPED;
+static unsigned int io_request;
+static int io_event = -1;
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_cond = PTHREAD_COND_INITIALIZER;
+
+static uint32_t transaction_id;
+/* bulk thread only: operation code of the current transaction */
+static uint16_t transaction_code;
+static uint16_t device_status = PIMA15740_RESP_OK;
+/* bulk thread only: the current transaction has been dropped by a reset */
+static int io_aborted;
 
-			/* Need to wait for control thread to finish reset */
-			sem_wait(&reset);
-		} else
-			count += ret;
-	} while (count < length);
+/*
+ * A write, which the host doesn't pick up within IO_WRITE_TIMEOUT_MS, fails
+ * the transaction. The bulk thread's timer kicks it out of write() with
+ * SIGINT, like ep0 does, an expired timer tells the two apart.
+ */
+#define IO_WRITE_TIMEOUT_MS	5000
 
-	if (verbose)
-		fprintf(stderr, "BULK-IN Sent %u bytes\n", count);
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id	_sigev_un._tid
+#endif
 
-	return count;
+static timer_t io_timer;
+static int io_timer_valid;
+/* bulk thread only: the last write has timed out */
+static int io_timed_out;
+/* Bulk-in has been halted by io_stall(), until the host sends a command */
+static int io_halted;
+
+/* the receive thread, see recv_thread() */
+static pthread_t recv_pthread;
+static int recv_running, recv_parked;
+
+static void recv_flush(void);
+
+/*
+ * The bus is suspended. gadgetfs reports no resume, the first transfer or
+ * control request after a suspend is taken as one.
+ */
+static int suspended;
+static struct timespec suspend_time;
+
+/* ep0 context */
+static void io_suspend(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &suspend_time);
+	__atomic_store_n(&suspended, 1, __ATOMIC_RELEASE);
 }
 
-static int send_association_handle(int n, struct ptp_container *s)
+/* ep0 or receive thread */
+static void io_resume(void)
 {
-	uint32_t *handle;
+	struct timespec now;
 
-	s->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
-	/* One array element */
-	*(uint32_t *)s->payload = __cpu_to_le32(1);
-	s->length = __cpu_to_le32(2 * sizeof(uint32_t) + sizeof(*s));
+	if (!__atomic_exchange_n(&suspended, 0, __ATOMIC_ACQ_REL) || !verbose)
+		return;
 
-	handle = (uint32_t *)s->payload + 1;
-	/* The next directory */
-	*handle = __cpu_to_le32(n);
-	return bulk_write(s, (void *)(handle + 1) - (void *)s);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	fprintf(stderr, "RESUME after %ld ms\n",
+		(now.tv_sec - suspend_time.tv_sec) * 1000 +
+		(now.tv_nsec - suspend_time.tv_nsec) / 1000000);
 }
 
-static int send_object_handles(void *recv_buf, void *send_buf, size_t send_len)
+static enum io_state io_get_state(void)
 {
-	struct ptp_container *r_container = recv_buf;
-	struct ptp_container *s_container = send_buf;
-	unsigned long length;
-	uint32_t *param;
-	uint32_t store_id;
-	struct obj_list *obj;
-	int ret;
-	uint32_t *handle;
-	uint32_t format, association;
-	int obj_to_send = object_number;
+	enum io_state state;
 
-	length	= __le32_to_cpu(r_container->length);
+	pthread_mutex_lock(&io_lock);
+	state = io_state;
+	pthread_mutex_unlock(&io_lock);
 
-	param = (uint32_t *)r_container->payload;
-	store_id = __le32_to_cpu(*param);
+	return state;
+}
 
-	/* supported storage IDs: 0x00010001 - our single storage, 0xffffffff - all stores */
-	if (store_id != STORE_ID && store_id != PTP_PARAM_ANY) {
-		make_response(s_container, r_container,
-			      PIMA15740_RESP_INVALID_STORAGE_ID, sizeof(*s_container));
-		return 0;
-	}
+static void io_set_state(enum io_state state)
+{
+	pthread_mutex_lock(&io_lock);
+	io_state = state;
+	pthread_cond_broadcast(&io_cond);
+	pthread_mutex_unlock(&io_lock);
+}
 
-	format = __le32_to_cpu(*(param + 1));
-	if (length > 16 && format != PTP_PARAM_UNUSED && format != PTP_PARAM_ANY) {
-		make_response(s_container, r_container,
-			      PIMA15740_RESP_SPECIFICATION_BY_FORMAT_NOT_SUPPORTED,
-			      sizeof(*s_container));
-		return 0;
-	}
+/* ep0 context, called with io_lock held */
+static void io_kick(void)
+{
+	pthread_kill(bulk_pthread, SIGINT);
+	if (recv_running)
+		pthread_kill(recv_pthread, SIGINT);
+}
 
-	association = __le32_to_cpu(*(param + 2));
-	if (length > 20 && association != PTP_PARAM_UNUSED && association != 2) {
-		enum pima15740_response_code code;
-		if (!object_handle_valid(association) && association != PTP_PARAM_ANY)
-			code = PIMA15740_RESP_INVALID_OBJECT_HANDLE;
-		else if (association == PTP_PARAM_ANY) {
-			/* "/" is requested */
-			ret = send_association_handle(1, s_container);
-			if (ret < 0) {
-				errno = EPIPE;
-				return ret;
-			} else
-				code = PIMA15740_RESP_OK;
-		} else if (association == 1) {
-			/* The subdirectory of "/DCIM" is requested */
-			ret = send_association_handle(2, s_container);
-			if (ret < 0) {
-				errno = EPIPE;
-				return ret;
-			} else
-				code = PIMA15740_RESP_OK;
-		} else
-			code = PIMA15740_RESP_INVALID_PARENT_OBJECT;
+/* ep0 context, called with io_lock held */
+static void io_post(unsigned int req)
+{
+	uint64_t one = 1;
 
-		make_response(s_container, r_container, code, sizeof(*s_container));
-		return 0;
+	__atomic_or_fetch(&io_request, req, __ATOMIC_RELEASE);
+	if (write(io_event, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("io_event");
+	io_kick();
+}
+
+/* ep0 context, called with io_lock held, wait until @done or timeout */
+static int io_wait_ack(int (*done)(void))
+{
+	struct timespec ts;
+	int waited;
+
+	for (waited = 0; !done() && waited < IO_ACK_MS; waited += IO_KICK_MS) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += IO_KICK_MS * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&io_cond, &io_lock, &ts);
+		/* The kick may have landed outside of a system call */
+		if (!done())
+			io_kick();
 	}
 
-	if (association == 2)
-		/* Only send contents of /DCIM/100LINUX */
-		obj_to_send -= 2;
+	return done() ? 0 : -ETIMEDOUT;
+}
 
-	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
-	*(uint32_t *)s_container->payload = __cpu_to_le32(obj_to_send);
-	s_container->length = __cpu_to_le32((obj_to_send + 1) * sizeof(uint32_t) +
-					    sizeof(*s_container));
+static int io_parked(void)
+{
+	return (io_state == IO_PARKED || io_state == IO_STOPPED) &&
+		(recv_parked || !recv_running);
+}
 
-	handle = (uint32_t *)s_container->payload + 1;
+static void io_unlock(void *param)
+{
+	pthread_mutex_unlock(&io_lock);
+}
 
-	if (association != 2) {
-		/* The two directories */
-		*handle++ = __cpu_to_le32(1);
-		*handle++ = __cpu_to_le32(2);
-	}
+/* bulk or receive thread, called with io_lock held: sit out a reset */
+static void io_park(void)
+{
+	pthread_cleanup_push(io_unlock, NULL);
+	pthread_cond_broadcast(&io_cond);
+	while (io_request & IO_REQ_RESET)
+		pthread_cond_wait(&io_cond, &io_lock);
+	pthread_cleanup_pop(0);
+}
 
-	for (obj = images; obj; obj = obj->next) {
-		if ((void *)handle == send_buf + send_len) {
-			ret = bulk_write(send_buf, send_len);
-			if (ret < 0) {
-				errno = EPIPE;
-				return ret;
-			}
-			handle = send_buf;
-		}
+static int io_cancel_done(void)
+{
+	return !(io_request & IO_REQ_CANCEL);
+}
 
-		*handle++ = __cpu_to_le32(obj->handle);
-	}
-	if ((void *)handle > send_buf) {
-		ret = bulk_write(send_buf, (void *)handle - send_buf);
-		if (ret < 0) {
-			errno = EPIPE;
-			return ret;
-		}
+/* ep0 context */
+static void cancel_transaction(uint32_t id)
+{
+	pthread_mutex_lock(&io_lock);
+
+	if (io_state != IO_BUSY || transaction_id != id) {
+		if (verbose)
+			fprintf(stderr, "Cancel for inactive transaction %u\n", id);
+		goto unlock;
 	}
 
-	/* Prepare response */
-	make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+	__atomic_store_n(&device_status, PIMA15740_RESP_DEVICE_BUSY, __ATOMIC_RELAXED);
+	io_post(IO_REQ_CANCEL);
+	if (io_wait_ack(io_cancel_done) < 0 && verbose)
+		fprintf(stderr, "Cancel of transaction %u still pending\n", id);
 
-	return 0;
+unlock:
+	pthread_mutex_unlock(&io_lock);
 }
 
-static int send_association(int n, struct ptp_container *s, size_t size)
+/* bulk thread context, once the data loop has been left */
+static void transaction_cancelled(void)
 {
-	struct ptp_object_info *objinfo = (struct ptp_object_info *)s->payload;
-	size_t len, total;
-	int ret;
+	/* Drop data, that is still queued, and unstall the pipes */
+	if (ioctl(bulk_in, GADGETFS_FIFO_FLUSH) < 0 && errno != EOPNOTSUPP)
+		perror("flush source fd");
+	if (ioctl(bulk_in, GADGETFS_CLEAR_HALT) < 0)
+		perror("reset source fd");
+	if (ioctl(bulk_out, GADGETFS_CLEAR_HALT) < 0)
+		perror("reset sink fd");
 
-	s->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
-	memcpy(objinfo, &association, sizeof(association));
-	objinfo->object_compressed_size = __cpu_to_le32(size);
-	switch (n) {
-	case 1:
-		len = strlen("DCIM") + 1;
-		ret = put_string(ic, (char *)objinfo->strings + 1, "DCIM", len);
-		objinfo->parent_object = __cpu_to_le32(0);
-		break;
-	case 2:
-		len = strlen(PTP_MODEL_DIR) + 1;
-		ret = put_string(ic, (char *)objinfo->strings + 1, PTP_MODEL_DIR, len);
-		objinfo->parent_object = __cpu_to_le32(1);
-		break;
-	}
-	if (ret < 0)
-		return ret;
-	objinfo->strings[0] = len;
-	objinfo->strings[2 * len + 1] = 0;	/* Empty Capture Date */
-	objinfo->strings[2 * len + 2] = 0;	/* Empty Modification Date */
-	objinfo->strings[2 * len + 3] = 0;	/* Empty Keywords */
-	total = 2 * len + 4 + sizeof(*s) + sizeof(*objinfo);
-	s->length = __cpu_to_le32(total);
+	__atomic_store_n(&device_status, PIMA15740_RESP_TRANSACTION_CANCELLED, __ATOMIC_RELAXED);
 
-	return bulk_write(s, total);
+	pthread_mutex_lock(&io_lock);
+	__atomic_and_fetch(&io_request, ~IO_REQ_CANCEL, __ATOMIC_RELEASE);
+	io_state = IO_IDLE;
+	pthread_cond_broadcast(&io_cond);
+	pthread_mutex_unlock(&io_lock);
+
+	if (verbose)
+		fprintf(stderr, "Transaction %u cancelled\n", transaction_id);
 }
 
-static int send_object_info(void *recv_buf, void *send_buf, size_t send_len)
+/*
+ * bulk thread context: io_post() sets the request before it writes the
+ * eventfd, so the request may already have been handled when the eventfd
+ * fires. It is drained whenever it is seen, not only along with a request.
+ */
+static void io_event_drain(void)
 {
-	struct ptp_container *r_container = recv_buf;
-	struct ptp_container *s_container = send_buf;
-	uint32_t *param;
-	struct obj_list *obj;
-	int ret;
-	uint32_t handle;
-	size_t count, total, offset;
-	void *info;
-	enum pima15740_response_code code = PIMA15740_RESP_OK;
+	uint64_t cnt;
 
-	param = (uint32_t *)r_container->payload;
-	handle = __le32_to_cpu(*param);
-
-	if (handle == 1 || handle == 2) {
-		struct stat dstat;
-		size_t size;
+	if (read(io_event, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		perror("io_event");
+}
 
-		/* Directory information requested */
-		if (handle == 2) {
-			ret = stat(root, &dstat);
-			if (ret < 0) {
-				errno = EPIPE;
-				return ret;
-			}
-			size = dstat.st_size;
-			if (verbose > 1)
-				fprintf(stderr, "%s size %u\n", root, size);
-		} else
-			size = 4096;
-		ret = send_association(handle, s_container, size);
-		if (ret < 0) {
-			errno = EPIPE;
-			return ret;
-		}
+/*
+ * bulk thread context: act upon requests from ep0. Returns -1 with errno set
+ * if the current transaction has to be abandoned. While idle, a cancel can
+ * only be a stale one, that has raced with the end of its transaction.
+ */
+static int io_check(void)
+{
+	unsigned int req = __atomic_load_n(&io_request, __ATOMIC_ACQUIRE);
 
-		goto send_resp;
+	if (io_aborted) {
+		errno = ECONNRESET;
+		return -1;
 	}
 
-	for (obj = images; obj; obj = obj->next)
-		if (obj->handle == handle)
-			break;
+	if (!req)
+		return 0;
 
-	if (!obj) {
-		code = PIMA15740_RESP_INVALID_OBJECT_HANDLE;
-		goto send_resp;
+	io_event_drain();
+
+	if (req & IO_REQ_FLUSH) {
+		enum io_state prev;
+
+		/* Only the consumer may drop what is in the receive ring now */
+		recv_flush();
+
+		pthread_mutex_lock(&io_lock);
+		__atomic_and_fetch(&io_request, ~IO_REQ_FLUSH, __ATOMIC_RELEASE);
+		prev = io_state;
+		io_state = IO_IDLE;
+		pthread_mutex_unlock(&io_lock);
+
+		if (prev == IO_BUSY) {
+			io_aborted = 1;
+			errno = ECONNRESET;
+			return -1;
+		}
 	}
 
-	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
-	total = obj->info_size + sizeof(*s_container);
-	s_container->length = __cpu_to_le32(total);
-	offset = sizeof(*s_container);
-	info = &obj->info;
+	if (req & IO_REQ_RESET) {
+		enum io_state prev;
 
-	/* Object Info cannot get > 4096 bytes - four strings make a maximum of 2048
-	 * bytes plus a fixed-size block, but we play safe for the case someone
-	 * makes the buffers smaller */
+		pthread_mutex_lock(&io_lock);
+		prev = io_state;
+		io_state = IO_PARKED;
+		io_park();
+		io_state = IO_IDLE;
+		pthread_mutex_unlock(&io_lock);
 
-	while (total) {
-		count = min(total, send_len);
-		memcpy(send_buf + offset, info, count - offset);
-		info += count - offset;
-		ret = bulk_write(send_buf, count);
-		if (ret < 0) {
-			errno = EPIPE;
-			return ret;
+		if (prev == IO_BUSY) {
+			io_aborted = 1;
+			errno = ECONNRESET;
+			return -1;
 		}
-		offset = 0;
-		total -= count;
+		return 0;
 	}
 
-send_resp:
-	/* Prepare response */
-	make_response(s_container, r_container, code, sizeof(*s_container));
+	if (req & IO_REQ_CANCEL) {
+		if (io_get_state() == IO_BUSY) {
+			errno = ECANCELED;
+			return -1;
+		}
+		pthread_mutex_lock(&io_lock);
+		__atomic_and_fetch(&io_request, ~IO_REQ_CANCEL, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&io_cond);
+		pthread_mutex_unlock(&io_lock);
+	}
 
 	return 0;
 }
 
-static int send_object_or_thumb(void *recv_buf, void *send_buf, size_t send_len, int thumb)
+/* bulk thread context: wait for @fd or a request from ep0 */
+static int io_wait(int fd, short events)
 {
-	struct ptp_container *r_container = recv_buf;
-	struct ptp_container *s_container = send_buf;
-	uint32_t *param;
-	struct obj_list *obj;
+	struct pollfd p[2] = {
+		{ .fd = fd,		.events = events, },
+		{ .fd = io_event,	.events = POLLIN, },
+	};
 	int ret;
-	uint32_t handle;
-	size_t count, total, offset, file_size;
-	void *data, *map;
-	int fd;
-	char name[256];
 
-	param = (uint32_t *)r_container->payload;
-	handle = __le32_to_cpu(*param);
+	for (;;) {
+		if (io_check() < 0)
+			return -1;
 
-	for (obj = images; obj; obj = obj->next)
-		if (obj->handle == handle)
-			break;
+		ret = poll(p, 2, -1);
+		if (ret < 0 && errno != EINTR)
+			return ret;
+		if (ret <= 0)
+			continue;
 
-	if (!obj) {
-		make_response(s_container, r_container, PIMA15740_RESP_INVALID_OBJECT_HANDLE,
-			      sizeof(*s_container));
-		return 0;
+		if (p[1].revents & POLLIN)
+			io_event_drain();
+
+		/* A request, that came in together with @fd, is acted upon first */
+		if (p[0].revents & (events | POLLERR | POLLHUP))
+			return io_check();
 	}
+}
 
-	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
-	offset = sizeof(*s_container);
+static int cancel_requested(void)
+{
+	return (__atomic_load_n(&io_request, __ATOMIC_ACQUIRE) & IO_REQ_CANCEL) &&
+		io_get_state() == IO_BUSY;
+}
 
-	if (!thumb) {
-		strncpy(name, obj->name, sizeof(name) - 1);
-		name[sizeof(name) - 1] = '\0';
-		ret = chdir(root);
-		file_size = __le32_to_cpu(obj->info.object_compressed_size);
-	} else {
-		char *dot = strrchr(obj->name, '.');
-		*dot = '\0';			/* We know there is a dot in the name */
-		snprintf(name, sizeof(name) - 1, "%s.thumb.jpeg", obj->name);
-		*dot = '.';
-		name[sizeof(name) - 1] = '\0';
-		ret = chdir(THUMB_LOCATION);
-		file_size = __le32_to_cpu(obj->info.thumb_compressed_size);
-	}
+/*
+ * Command read-ahead: the receive thread always keeps a read posted on
+ * bulk-out and hands each completed transfer to the bulk thread through a
+ * single-producer, single-consumer ring. The indices are only touched with
+ * atomics, either side sleeps on its eventfd only when the ring is empty or
+ * full, and is woken up only if it has announced that it is sleeping. The
+ * slots are page aligned BUF_SIZE parts of one buffer from the transfer pool.
+ */
+#define RECV_SLOTS	8
 
-	total = file_size + sizeof(*s_container);
-	if (verbose)
-		fprintf(stderr, "%s(): total %d\n", __func__, total);
-	s_container->length = __cpu_to_le32(total);
+struct recv_slot {
+	size_t		len;
+	size_t		off;
+	int		err;
+	uint8_t		*buf;
+};
 
-	if (!ret)
-		fd = open(name, O_RDONLY);
-	if (ret < 0 || fd < 0) {
-		make_response(s_container, r_container, PIMA15740_RESP_INCOMPLETE_TRANSFER,
-			      sizeof(*s_container));
-		return 0;
-	}
+static struct recv_slot recv_ring[RECV_SLOTS];
+static void *recv_ring_buf;
+static unsigned int recv_head, recv_tail;
+static int recv_data_ev = -1, recv_space_ev = -1;
+static int recv_consumer_waiting, recv_producer_waiting;
 
-	map = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
-	if (map == MAP_FAILED) {
-		close(fd);
-		make_response(s_container, r_container, PIMA15740_RESP_INCOMPLETE_TRANSFER,
-			      sizeof(*s_container));
-		return 0;
-	}
+static void recv_wake(int fd, int *waiting)
+{
+	uint64_t one = 1;
 
-	count = min(total, send_len);
-	memcpy(send_buf + offset, map, count - offset);
-	ret = bulk_write(send_buf, count);
-	if (ret < 0) {
-		errno = EPIPE;
-		goto out;
-	}
-	total -= count;
-	data = map + count - offset;
-	send_len = 8 * 1024;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_RELAXED) &&
+	    write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("recv wake");
+}
 
-	while (total) {
-		count = min(total, send_len);
-		ret = bulk_write(data, count);
-		if (ret < 0) {
-			errno = EPIPE;
-			goto out;
-		}
-		total -= count;
-		data += count;
-	}
-	ret = 0;
+/*
+ * Announce that we are going to sleep, then re-check @ready before sleeping.
+ * The bulk thread passes io_event as @event, to return to io_check() on a
+ * request from ep0, the receive thread passes -1.
+ */
+static int recv_sleep(int fd, int *waiting, int (*ready)(void), int event)
+{
+	struct pollfd p[2] = {
+		{ .fd = fd,		.events = POLLIN, },
+		{ .fd = event,		.events = POLLIN, },
+	};
+	uint64_t cnt;
+	int ret = 0;
 
-out:
-	munmap(map, file_size);
-	close(fd);
+	__atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+	if (!ready())
+		ret = poll(p, 2, -1);
+	__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
 
-	if (!ret)
-		/* Prepare response */
-		make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+	if (read(fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		perror("recv sleep");
+	if (ret > 0 && (p[1].revents & POLLIN))
+		io_event_drain();
 
 	return ret;
 }
 
-static int send_storage_ids(void *recv_buf, void *send_buf, size_t send_len)
+static int recv_has_space(void)
 {
-	struct ptp_container *s_container = send_buf;
-	uint32_t *param;
-	int ret;
+	return recv_tail - __atomic_load_n(&recv_head, __ATOMIC_ACQUIRE) < RECV_SLOTS;
+}
 
-	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
-	s_container->length = __cpu_to_le32(20);
-	param = (uint32_t *)s_container->payload;
+static int recv_has_data(void)
+{
+	return __atomic_load_n(&recv_tail, __ATOMIC_ACQUIRE) != recv_head;
+}
 
-	*param = __cpu_to_le32(1);
-	*(param + 1) = __cpu_to_le32(STORE_ID);
-	ret = bulk_write(send_buf, 20);
-	if (ret < 0) {
-		errno = EPIPE;
-		return ret;
-	}
+static void *recv_thread(void *param)
+{
+	struct recv_slot *slot;
+	int ret;
 
-	/* Prepare response */
-	memcpy(send_buf, recv_buf, sizeof(*s_container));
-	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_RESPONSE_BLOCK);
-	s_container->code = __cpu_to_le16(PIMA15740_RESP_OK);
-	s_container->length = __cpu_to_le32(sizeof(*s_container));
+	for (;;) {
+		if (io_request & IO_REQ_RESET) {
+			pthread_mutex_lock(&io_lock);
+			recv_parked = 1;
+			io_park();
+			recv_parked = 0;
+			pthread_mutex_unlock(&io_lock);
+			continue;
+		}
 
-	return 0;
-}
+		if (!recv_has_space()) {
+			recv_sleep(recv_space_ev, &recv_producer_waiting, recv_has_space, -1);
+			continue;
+		}
 
-static int send_storage_info(void *recv_buf, void *send_buf, size_t send_len)
-{
-	struct ptp_container *r_container = recv_buf;
-	struct ptp_container *s_container = send_buf;
-	uint32_t *param;
-	uint32_t store_id;
-	unsigned long long bytes;
-	int ret;
-	size_t count;
-	struct statfs fs;
+		slot = &recv_ring[recv_tail % RECV_SLOTS];
+		ret = read(bulk_out, slot->buf, BUF_SIZE);
+		if (ret < 0 && errno == EINTR)
+			continue;
 
-	param = (uint32_t *)r_container->payload;
-	store_id = __le32_to_cpu(*param);
+		slot->off = 0;
+		slot->len = ret < 0 ? 0 : ret;
+		slot->err = ret < 0 ? errno : 0;
 
-	if (verbose)
-		fprintf(stderr, "%u bytes storage info\n", sizeof(storage_info));
+		if (ret >= 0 && __atomic_load_n(&suspended, __ATOMIC_RELAXED))
+			io_resume();
 
-	if (store_id != STORE_ID) {
-		make_response(s_container, r_container,
-			      PIMA15740_RESP_INVALID_STORAGE_ID, sizeof(*s_container));
-		return 0;
-	}
+		__atomic_store_n(&recv_tail, recv_tail + 1, __ATOMIC_RELEASE);
+		recv_wake(recv_data_ev, &recv_consumer_waiting);
 
-	ret = statfs(root, &fs);
-	if (ret < 0) {
-		make_response(s_container, r_container,
-			      PIMA15740_RESP_ACCESS_DENIED, sizeof(*s_container));
-		return 0;
+		/* The bulk thread will see the error and terminate */
+		if (ret < 0)
+			break;
 	}
 
-	if (verbose > 1)
-		fprintf(stderr, "Block-size %d, total 0x%lx, free 0x%lx\n",
-			fs.f_bsize, fs.f_blocks, fs.f_bfree);
+	return NULL;
+}
 
-	count = sizeof(storage_info) + sizeof(*s_container);
+/* bulk thread: copy up to @length bytes of the next received transfer */
+static int recv_pop(void *buf, size_t length)
+{
+	struct recv_slot *slot;
+	size_t n;
 
-	s_container->type	= __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
-	s_container->length	= __cpu_to_le32(count);
+	for (;;) {
+		if (io_check() < 0)
+			return -1;
+		if (recv_has_data())
+			break;
+		recv_sleep(recv_data_ev, &recv_consumer_waiting, recv_has_data, io_event);
+	}
 
-	bytes					= (unsigned long long)fs.f_bsize * fs.f_blocks;
-	storage_info.max_capacity		= __cpu_to_le64(bytes);
-	bytes					= (unsigned long long)fs.f_bsize * fs.f_bfree;
-	storage_info.free_space_in_bytes	= __cpu_to_le64(bytes);
-	storage_info.free_space_in_images	= __cpu_to_le32(PTP_PARAM_ANY);
+	slot = &recv_ring[recv_head % RECV_SLOTS];
+	if (slot->err) {
+		errno = slot->err;
+		return -1;
+	}
 
-	memcpy(send_buf + sizeof(*s_container), &storage_info, sizeof(storage_info));
-	ret = bulk_write(s_container, count);
-	if (ret < 0) {
-		errno = EPIPE;
-		return ret;
+	n = min(length, slot->len - slot->off);
+	memcpy(buf, slot->buf + slot->off, n);
+	slot->off += n;
+
+	if (slot->off == slot->len) {
+		__atomic_store_n(&recv_head, recv_head + 1, __ATOMIC_RELEASE);
+		recv_wake(recv_space_ev, &recv_producer_waiting);
 	}
 
-	/* Prepare response */
-	make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+	return n;
+}
 
-	return 0;
+/* ep0 context, with both threads parked or stopped, or the bulk thread: drop stale transfers */
+static void recv_flush(void)
+{
+	__atomic_store_n(&recv_head, __atomic_load_n(&recv_tail, __ATOMIC_ACQUIRE),
+			 __ATOMIC_RELEASE);
+	recv_wake(recv_space_ev, &recv_producer_waiting);
 }
 
-static void delete_thumb(struct obj_list *obj)
+static int recv_start(void)
 {
-	char thumb[256];
-	char *dot;
+	int i, ret;
 
-	if (__le16_to_cpu(obj->info.thumb_format) != PIMA15740_FMT_I_JFIF)
-		return;
+	recv_ring_buf = xfer_get();
+	if (!recv_ring_buf) {
+		fprintf(stderr, "No transfer buffer for the receive ring\n");
+		return -1;
+	}
+	for (i = 0; i < RECV_SLOTS; i++)
+		recv_ring[i].buf = recv_ring_buf + i * BUF_SIZE;
 
-	dot = strrchr(obj->name, '.');
-	if (!dot || dot == obj->name)
-		return;
+	recv_head = recv_tail = 0;
+	recv_parked = 0;
 
-	*dot = 0;
-	snprintf(thumb, sizeof(thumb), THUMB_LOCATION "%s.thumb.jpeg",
-		 obj->name);
-	*dot = '.';
+	ret = pthread_create(&recv_pthread, NULL, recv_thread, NULL);
+	if (ret) {
+		errno = ret;
+		perror("can't create receive thread");
+		xfer_put(recv_ring_buf);
+		recv_ring_buf = NULL;
+		return -1;
+	}
+	recv_running = 1;
 
-	if (unlink(thumb))
-		fprintf(stderr, "Cannot delete %s: %s\n",
-			thumb, strerror(errno));
+	return 0;
 }
 
-static enum pima15740_response_code delete_file(const char *name)
+static void recv_stop(void)
 {
-	struct stat st;
-	int ret;
-	uid_t euid;
-	gid_t egid;
+	if (!recv_running)
+		return;
 
-	/* access() is unreliable on NFS, we use stat() instead */
-	ret = stat(name, &st);
-	if (ret < 0) {
-		fprintf(stderr, "Cannot stat %s: %s\n", name, strerror(errno));
-		return PIMA15740_RESP_GENERAL_ERROR;
-	}
+	pthread_cancel(recv_pthread);
+	pthread_join(recv_pthread, NULL);
+	recv_running = 0;
 
-	euid = geteuid();
-	if (euid == st.st_uid) {
-		if (!(st.st_mode & S_IWUSR))
-			return PIMA15740_RESP_OBJECT_WRITE_PROTECTED;
-		goto del;
-	}
+	xfer_put(recv_ring_buf);
+	recv_ring_buf = NULL;
+}
 
-	egid = getegid();
-	if (egid == st.st_gid) {
-		if (!(st.st_mode & S_IWGRP))
-			return PIMA15740_RESP_OBJECT_WRITE_PROTECTED;
-		goto del;
+static unsigned int bulk_maxpacket(void)
+{
+	switch (current_speed) {
+	case USB_SPEED_SUPER:
+		return MAX_PACKET_SIZE_SS;
+	case USB_SPEED_HIGH:
+		return MAX_PACKET_SIZE_HS;
+	default:
+		return MAX_PACKET_SIZE_FS;
 	}
+}
 
-	if (!(st.st_mode & S_IWOTH))
-		return PIMA15740_RESP_OBJECT_WRITE_PROTECTED;
+/* bulk thread context */
+static void io_timer_init(void)
+{
+	struct sigevent sev = {
+		.sigev_notify		= SIGEV_THREAD_ID,
+		.sigev_signo		= SIGINT,
+	};
 
-del:
-	ret = unlink(name);
-	if (ret) {
-		fprintf(stderr, "Cannot delete %s: %s\n",
-			name, strerror(errno));
-		return PIMA15740_RESP_GENERAL_ERROR;
-	}
+	sev.sigev_notify_thread_id = syscall(SYS_gettid);
+	io_timer_valid = !timer_create(CLOCK_MONOTONIC, &sev, &io_timer);
+	if (!io_timer_valid)
+		perror("No write timeout, timer_create");
+}
 
-	return PIMA15740_RESP_OK;
+/* Also a cleanup handler for the cancelled bulk thread */
+static void io_timer_exit(void *param)
+{
+	if (io_timer_valid)
+		timer_delete(io_timer);
+	io_timer_valid = 0;
 }
 
-static int update_free_space(void)
+static void io_timer_set(unsigned int ms)
 {
-	unsigned long long bytes;
-	struct statfs fs;
-	int ret;
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec		= ms / 1000,
+			.tv_nsec	= (ms % 1000) * 1000000,
+		},
+	};
 
-	ret = statfs(root, &fs);
-	if (ret < 0) {
-		fprintf(stderr, "statfs %s: %s\n", root, strerror(errno));
-		return ret;
-	}
+	if (io_timer_valid)
+		timer_settime(io_timer, 0, &its, NULL);
+}
 
-	if (verbose > 1)
-		fprintf(stdout, "Block-size %d, total %d, free %d\n",
-			fs.f_bsize, (int)fs.f_blocks, (int)fs.f_bfree);
+static int io_timer_expired(void)
+{
+	struct itimerspec its;
 
-	bytes = (unsigned long long)fs.f_bsize * fs.f_bfree;
-	storage_info.free_space_in_bytes = __cpu_to_le64(bytes);
-	return 0;
+	return io_timer_valid && !timer_gettime(io_timer, &its) &&
+		!its.it_value.tv_sec && !its.it_value.tv_nsec;
 }
 
-static void delete_object(void *recv_buf, void *send_buf)
+static int usb_write(void *buf, size_t length)
 {
-	struct ptp_container *r_container = recv_buf;
-	struct ptp_container *s_container = send_buf;
-	enum pima15740_response_code code = PIMA15740_RESP_OK;
-	uint32_t format, handle;
-	uint32_t *param;
-	unsigned long length;
-	int ret = 0;
+	size_t count = 0;
+	int ret, expired;
 
-	length = __le32_to_cpu(r_container->length);
+	do {
+		ret = io_wait(bulk_in, POLLOUT);
+		if (ret < 0)
+			return ret;
 
-	param = (uint32_t *)r_container->payload;
-	handle = __le32_to_cpu(*param);
-	format = __le32_to_cpu(*(param + 1));
+		io_timer_set(IO_WRITE_TIMEOUT_MS);
+		ret = write(bulk_in, buf + count, length - count);
+		expired = ret < 0 && errno == EINTR && io_timer_expired();
+		io_timer_set(0);
+
+		/* A suspended host will read once it has resumed */
+		if (expired && !__atomic_load_n(&suspended, __ATOMIC_RELAXED)) {
+			fprintf(stderr, "BULK-IN write of %zu bytes timed out\n", length - count);
+			io_timed_out = 1;
+			errno = ETIMEDOUT;
+			return -1;
+		}
 
-	if (length > 16 && format != PTP_PARAM_UNUSED) {
-		/* ObjectFormatCode not supported */
-		code = PIMA15740_RESP_SPECIFICATION_BY_FORMAT_NOT_SUPPORTED;
-		goto resp;
-	} else if (handle == 1 || handle == 2) {
-		/* read-only /DCIM and /DCIM/100LINUX */
-		code = PIMA15740_RESP_OBJECT_WRITE_PROTECTED;
-		goto resp;
+		if (ret < 0) {
+			if (errno != EINTR)
+				return ret;
+		} else
+			count += ret;
+	} while (count < length);
+
+	if (verbose)
+		fprintf(stderr, "BULK-IN Sent %u bytes\n", count);
+
+	return count;
+}
+
+/*
+ * The transaction engine does all of its bulk I/O through a sink: normally
+ * the gadgetfs endpoints, in replay mode (-P) a recorded host session.
+ */
+struct ptp_sink {
+	int (*write)(void *buf, size_t length);
+	int (*read)(void *buf, size_t length);
+	/* Drop what has been received and not read yet */
+	void (*flush)(void);
+};
+
+static const struct ptp_sink usb_sink = {
+	.write	= usb_write,
+	.read	= recv_pop,
+	.flush	= recv_flush,
+};
+
+static const struct ptp_sink *sink = &usb_sink;
+
+/*
+ * Session recording (-R): every bulk transfer is logged with a
+ * CLOCK_MONOTONIC timestamp. Host to device transfers are kept whole, of
+ * device to host ones only a container header's worth, which is enough to
+ * tell data from responses. Records are host-endian.
+ */
+#define REC_MAGIC	0x52505450	/* "PTPR" */
+#define REC_OUT		0		/* host to device */
+#define REC_IN		1		/* device to host */
+
+struct session_rec {
+	uint32_t	magic;
+	uint32_t	dir;
+	uint64_t	ns;
+	uint32_t	len;		/* of the transfer */
+	uint32_t	saved;		/* bytes of it following the record */
+} __attribute__ ((packed));
+
+static FILE *record_file;
+
+static int record_open(const char *path)
+{
+	record_file = fopen(path, "w");
+	if (!record_file) {
+		perror(path);
+		return -1;
 	}
 
-	ret = chdir(root);
-	if (ret) {
-		fprintf(stderr, "chdir %s: %s\n", root, strerror(errno));
-		code = PIMA15740_RESP_GENERAL_ERROR;
-		goto resp;
+	return 0;
+}
+
+/* bulk thread */
+static void record_put(int dir, const void *buf, size_t len)
+{
+	struct session_rec rec = {
+		.magic	= REC_MAGIC,
+		.dir	= dir,
+		.len	= len,
+		.saved	= dir == REC_OUT ? len : min(len, sizeof(struct ptp_container)),
+	};
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	rec.ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	if (fwrite(&rec, sizeof(rec), 1, record_file) != 1 ||
+	    fwrite(buf, 1, rec.saved, record_file) != rec.saved) {
+		perror("session record");
+		fclose(record_file);
+		record_file = NULL;
 	}
+}
 
-	if (handle == PTP_PARAM_ANY) {
-		struct obj_list *obj, **anchor;
-		int partial = 0;
+/* All bulk I/O of the transaction engine, through the sink and the recording */
+static int engine_write(void *buf, size_t length)
+{
+	int ret = sink->write(buf, length);
 
-		anchor = &images;
-		obj = images;
+	if (ret >= 0 && record_file)
+		record_put(REC_IN, buf, ret);
 
-		if (!obj) {
-			code = PIMA15740_RESP_OK;
-			goto resp;
-		}
+	return ret;
+}
 
-		while (obj) {
-			code = delete_file(obj->name);
-			if (code == PIMA15740_RESP_OK) {
-				delete_thumb(obj);
-				*anchor = obj->next;
-				free(obj);
-				obj = *anchor;
-				object_number--;
-			} else {
-				anchor = &obj->next;
-				obj = obj->next;
-				partial++;
-			}
-		}
+static int engine_read(void *buf, size_t length)
+{
+	int ret = sink->read(buf, length);
 
-		if (partial)
-			code = PIMA15740_RESP_PARTIAL_DELETION;
-	} else {
-		struct obj_list *obj, **anchor;
+	if (ret >= 0 && record_file)
+		record_put(REC_OUT, buf, ret);
 
-		anchor = &images;
-		obj = images;
+	return ret;
+}
 
-		while (obj) {
-			if (obj->handle == handle)
-				break;
-			anchor = &obj->next;
-			obj = obj->next;
-		}
+/*
+ * Allocation accounting for the replay report: built with REPLAY_ALLOCS=1,
+ * ptp is linked with --wrap=malloc,calloc,realloc, so these see all of its
+ * own allocations. They are counted per thread, the replaying thread reads
+ * its own counters, so that the prefetch, delete and scan threads are not
+ * charged to the operation being replayed.
+ */
+static __thread uint64_t alloc_count, alloc_bytes;
 
-		if (obj) {
-			code = delete_file(obj->name);
-			if (code == PIMA15740_RESP_OK) {
-				delete_thumb(obj);
-				*anchor = obj->next;
-				free(obj);
-				object_number--;
-			}
-		} else {
-			code = PIMA15740_RESP_INVALID_OBJECT_HANDLE;
-		}
-	}
+#ifdef REPLAY_ALLOCS
 
-	ret = update_free_space();
-	if (ret < 0)
-		code = PIMA15740_RESP_STORE_NOT_AVAILABLE;
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
 
-resp:
-	make_response(s_container, r_container, code, sizeof(*s_container));
+void *__wrap_malloc(size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+	return __real_malloc(size);
 }
 
-static int process_one_request(void *recv_buf, size_t *recv_size, void *send_buf, size_t *send_size)
+void *__wrap_calloc(size_t nmemb, size_t size)
 {
-	struct ptp_container *r_container = recv_buf;
-	struct ptp_container *s_container = send_buf;
-	uint32_t *param, p1, p2, p3;
-	unsigned long length = *recv_size, type, code, id;
-	size_t count = 0;
-	int ret;
+	alloc_count++;
+	alloc_bytes += nmemb * size;
+	return __real_calloc(nmemb, size);
+}
 
-	do {
-		ret = read(bulk_out, recv_buf + count, *recv_size - count);
-		if (ret < 0) {
-			if (errno != EINTR)
-				return ret;
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+	return __real_realloc(ptr, size);
+}
+#else
+#define __real_realloc	realloc
+#endif
 
-			/* Need to wait for control thread to finish reset */
-			sem_wait(&reset);
-		} else {
-			count += ret;
-			if (count >= sizeof(*s_container)) {
-				length	= __le32_to_cpu(r_container->length);
-				type	= __le16_to_cpu(r_container->type);
-				code	= __le16_to_cpu(r_container->code);
-				id	= __le32_to_cpu(r_container->id);
-			}
+/*
+ * Replay: host to device transfers are fed to the engine from a recording,
+ * as fast as it takes them, everything it sends is counted and dropped.
+ */
+static FILE *replay_file;
+static uint8_t *replay_buf;
+static size_t replay_len, replay_off, replay_size;
+static int replay_have, replay_eof;
+static uint64_t replay_first_ns, replay_last_ns, replay_sent;
+
+static int replay_next(void)
+{
+	struct session_rec rec;
+	uint8_t *buf;
+
+	for (;;) {
+		if (fread(&rec, sizeof(rec), 1, replay_file) != 1)
+			goto eof;
+		if (rec.magic != REC_MAGIC) {
+			fprintf(stderr, "Corrupt session record\n");
+			goto eof;
 		}
-	} while (count < length);
 
-	if (count > length) {
-		/* TODO: have to stall according to Figure 7.2-1? */
-		fprintf(stderr, "BULK-OUT ERROR: received %u byte, expected %lu\n",
-			count, length);
-		errno = EPIPE;
-		return -1;
+		if (!replay_first_ns)
+			replay_first_ns = rec.ns;
+		replay_last_ns = rec.ns;
+
+		if (rec.dir == REC_OUT)
+			break;
+		if (fseek(replay_file, rec.saved, SEEK_CUR) < 0)
+			goto eof;
 	}
 
-	memcpy(send_buf, recv_buf, sizeof(*s_container));
+	if (rec.saved > replay_size) {
+		/* Not to be counted against the operation being replayed */
+		buf = __real_realloc(replay_buf, rec.saved);
+		if (!buf)
+			goto eof;
+		replay_buf = buf;
+		replay_size = rec.saved;
+	}
 
-	if (verbose)
-		fprintf(stderr, "BULK-OUT Received %lu byte, type %lu, code 0x%lx, id %lu\n",
-			length, type, code, id);
+	if (fread(replay_buf, 1, rec.saved, replay_file) != rec.saved)
+		goto eof;
 
-	ret = -1;
+	replay_len = rec.saved;
+	replay_off = 0;
+	replay_have = 1;
 
-	switch (type) {
-	case PTP_CONTAINER_TYPE_COMMAND_BLOCK:
-		switch (code) {
-		case PIMA15740_OP_GET_DEVICE_INFO:
-			CHECK_COUNT(count, 12, 12, "GET_DEVICE_INFO");
+	return 0;
 
-			if (verbose)
-				fprintf(stderr, "%u bytes device info\n", sizeof(dev_info));
-			count = sizeof(dev_info) + sizeof(*s_container);
+eof:
+	replay_eof = 1;
+	errno = ENODATA;
+	return -1;
+}
 
-			/* First part: data block */
-			s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
-			s_container->length = __cpu_to_le32(count);
-			memcpy(send_buf + sizeof(*s_container), &dev_info, sizeof(dev_info));
-			ret = bulk_write(s_container, count);
-			if (ret < 0)
-				return ret;
-
-			/* Second part: response block */
-			s_container = send_buf + count;
-			make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+static int replay_read(void *buf, size_t length)
+{
+	size_t n;
 
-			break;
-		case PIMA15740_OP_OPEN_SESSION:
-			CHECK_COUNT(count, 16, 16, "OPEN_SESSION");
+	if (!replay_have && replay_next() < 0)
+		return -1;
 
-			ret = sizeof(*s_container);
-			param = (uint32_t *)r_container->payload;
-			p1 = __le32_to_cpu(*param);
-			if (verbose)
-				fprintf(stderr, "OpenSession %d\n", p1);
-			/* No multiple sessions. */
-			if (session > 0) {
-				/* already open */
-				code = PIMA15740_RESP_SESSION_ALREADY_OPEN;
-				*param = __cpu_to_le32(session);
-				ret += sizeof(*param);
-			} else if (!p1) {
-				code = PIMA15740_RESP_INVALID_PARAMETER;
-			} else {
-				code = PIMA15740_RESP_OK;
-				session = p1;
-			}
-			make_response(s_container, r_container, code, ret);
-			count = 0;
-			break;
-		case PIMA15740_OP_CLOSE_SESSION:
-			CHECK_COUNT(count, 12, 12, "CLOSE_SESSION");
+	n = min(length, replay_len - replay_off);
+	memcpy(buf, replay_buf + replay_off, n);
+	replay_off += n;
+	if (replay_off == replay_len)
+		replay_have = 0;
 
-			if (session > 0) {
-				code = PIMA15740_RESP_OK;
-				session = -EINVAL;
-			} else {
-				code = PIMA15740_RESP_SESSION_NOT_OPEN;
-			}
-			make_response(s_container, r_container, code, sizeof(*s_container));
-			ret = 0;
-			count = 0;
-			break;
-		case PIMA15740_OP_GET_OBJECT_HANDLES:
-			CHECK_COUNT(count, 16, 24, "GET_OBJECT_HANDLES");
-			CHECK_SESSION(s_container, r_container, &count, &ret);
+	return n;
+}
 
-			ret = send_object_handles(recv_buf, send_buf, *send_size);
-			count = ret; /* even if ret is negative, handled below */
-			break;
-		case PIMA15740_OP_GET_OBJECT_INFO:
-			CHECK_COUNT(count, 16, 16, "GET_OBJECT_INFO");
-			CHECK_SESSION(s_container, r_container, &count, &ret);
+static int replay_write(void *buf, size_t length)
+{
+	replay_sent += length;
+	return length;
+}
 
-			ret = send_object_info(recv_buf, send_buf, *send_size);
-			count = ret; /* even if ret is negative, handled below */
-			break;
-		case PIMA15740_OP_GET_STORAGE_IDS:
-			CHECK_COUNT(count, 12, 12, "GET_STORAGE_IDS");
-			CHECK_SESSION(s_container, r_container, &count, &ret);
+static void replay_flush(void)
+{
+	replay_have = 0;
+}
 
-			ret = send_storage_ids(recv_buf, send_buf, *send_size);
-			count = ret; /* even if ret is negative, handled below */
-			break;
-		case PIMA15740_OP_GET_STORAGE_INFO:
-			CHECK_COUNT(count, 16, 16, "GET_STORAGE_INFO");
-			CHECK_SESSION(s_container, r_container, &count, &ret);
+static const struct ptp_sink replay_sink = {
+	.write	= replay_write,
+	.read	= replay_read,
+	.flush	= replay_flush,
+};
 
-			ret = send_storage_info(recv_buf, send_buf, *send_size);
-			count = ret; /* even if ret is negative, handled below */
-			break;
-		case PIMA15740_OP_GET_OBJECT:
-			CHECK_COUNT(count, 16, 16, "GET_OBJECT");
-			CHECK_SESSION(s_container, r_container, &count, &ret);
+/*
+ * Events are queued by any thread and sent on the interrupt endpoint by a
+ * dedicated writer. Bursts are coalesced: the writer waits EVENT_COALESCE_MS
+ * after the first event, identical pending events are merged and an
+ * ObjectRemoved cancels a pending ObjectAdded for the same handle. When the
+ * queue overflows, pending object events are replaced by UnreportedStatus,
+ * for which the last slot is kept; other events are dropped while the queue
+ * is still full.
+ */
+#define EVENT_QUEUE_LEN		256
+#define EVENT_COALESCE_MS	20
 
-			ret = send_object_or_thumb(recv_buf, send_buf, *send_size, 0);
-			count = ret; /* even if ret is negative, handled below */
-			break;
-		case PIMA15740_OP_GET_NUM_OBJECTS:
-			CHECK_COUNT(count, 16, 24, "GET_NUM_OBJECTS");
-			CHECK_SESSION(s_container, r_container, &count, &ret);
+struct ptp_event {
+	uint16_t	code;
+	uint32_t	param;
+	uint32_t	id;		/* of the transaction, 0 if none */
+};
 
-			ret = 12;
-			param = (uint32_t *)r_container->payload;
-			p1 = __le32_to_cpu(*param);
-			p2 = __le32_to_cpu(*(param + 1));
-			p3 = __le32_to_cpu(*(param + 2));
-			if (p1 != PTP_PARAM_ANY && p1 != STORE_ID)
-				code = PIMA15740_RESP_INVALID_STORAGE_ID;
-			else if (count > 16 && p2 != PTP_PARAM_UNUSED && p2 != PTP_PARAM_ANY)
-				code = PIMA15740_RESP_SPECIFICATION_BY_FORMAT_NOT_SUPPORTED;
-			else if (count > 20 && p3 != PTP_PARAM_UNUSED) {
-				if (!object_handle_valid(p3))
-					code = PIMA15740_RESP_INVALID_OBJECT_HANDLE;
-				else if (p3 == PTP_PARAM_ANY || p3 == 1) {
-					/* root or DCIM - report one handle */
-					code = PIMA15740_RESP_OK;
-					ret += sizeof(*param);
-					*param = __cpu_to_le32(1);
-				} else if (p3 == 2) {
-					/* Contents of 100LINUX */
-					code = PIMA15740_RESP_OK;
-					ret += sizeof(*param);
-					*param = __cpu_to_le32(object_number - 2);
-				} else
-					code = PIMA15740_RESP_INVALID_PARENT_OBJECT;
-			} else {
-				/* No parent Association specified or 0 */
-				code = PIMA15740_RESP_OK;
-				ret += sizeof(*param);
-				*param = __cpu_to_le32(object_number);
-			}
-			make_response(s_container, r_container, code, ret);
-			count = 0;
-			break;
-		case PIMA15740_OP_GET_THUMB:
-			CHECK_COUNT(count, 16, 16, "GET_THUMB");
-			CHECK_SESSION(s_container, r_container, &count, &ret);
+struct ptp_event_container {
+	uint32_t	length;
+	uint16_t	type;
+	uint16_t	code;
+	uint32_t	id;
+	uint32_t	param;
+} __attribute__ ((packed));
 
-			ret = send_object_or_thumb(recv_buf, send_buf, *send_size, 1);
-			count = ret; /* even if ret is negative, handled below */
-			break;
-		case PIMA15740_OP_DELETE_OBJECT:
-			CHECK_COUNT(count, 16, 20, "DELETE_OBJECT");
-			CHECK_SESSION(s_container, r_container, &count, &ret);
+static struct ptp_event event_queue[EVENT_QUEUE_LEN];
+static unsigned int event_count;
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t event_pthread;
+static int event_running;
 
-			delete_object(recv_buf, send_buf);
-			count = 0;
-			ret = 0;
-			break;
-		}
-		break;
-	}
+static int event_is_object(uint16_t code)
+{
+	return code == PIMA15740_EVENT_OBJECT_ADDED ||
+		code == PIMA15740_EVENT_OBJECT_REMOVED;
+}
 
-	if (ret < 0) {
-		if (errno == EPIPE)
-			return -1;
+/* Drop the events matching drop(), called with event_lock held */
+static void event_compact(int (*drop)(uint16_t code))
+{
+	unsigned int i, n = 0;
 
-		if (verbose)
-			fprintf(stderr, "Unsupported type %lu code %lu\n", type, code);
-		errno = EOPNOTSUPP;
-		make_response(s_container, r_container,
-			      PIMA15740_RESP_OPERATION_NOT_SUPPORTED, sizeof(*s_container));
-		count = 0;
-	}
+	for (i = 0; i < event_count; i++)
+		if (!drop(event_queue[i].code))
+			event_queue[n++] = event_queue[i];
+	event_count = n;
+}
 
-	/* send out response at send_buf + count */
-	s_container = send_buf + count;
-	length = __le32_to_cpu(s_container->length);
-	return bulk_write(s_container, length);
+static int event_is_cancelled(uint16_t code)
+{
+	return code == PIMA15740_EVENT_UNDEFINED;
 }
 
-static void *bulk_thread(void *param)
+/*
+ * Make room for one more event, if the queue is full, called with
+ * event_lock held. Returns 1 if events have been lost.
+ */
+static int event_overflow(void)
 {
-	void *recv_buf, *send_buf;
-	int ret;
-	size_t s_size = BUF_SIZE, r_size = BUF_SIZE;
+	unsigned int i;
 
-	recv_buf = malloc(BUF_SIZE);
-	send_buf = malloc(BUF_SIZE);
-	if (!recv_buf || !send_buf) {
-		if (verbose)
-			fprintf(stderr, "No memory!\n");
-		goto done;
-	}
+	/* The last slot is only for UnreportedStatus */
+	if (event_count < EVENT_QUEUE_LEN - 1)
+		return 0;
 
-	do {
-		ret = process_one_request(recv_buf, &r_size, send_buf, &s_size);
-		if (ret < 0 && errno == EPIPE) {
-			/* TODO: Have to stall and wait to be unstalled / exit
-			 * thread to be restarted */
-			fprintf(stderr, "Protocol error!\n");
-			break;
-		}
+	/* Placeholders of cancelled ObjectAdded events first */
+	event_compact(event_is_cancelled);
+	if (event_count < EVENT_QUEUE_LEN - 1)
+		return 0;
 
-		pthread_testcancel();
-	} while (ret >= 0);
+	event_compact(event_is_object);
+	for (i = 0; i < event_count; i++)
+		if (event_queue[i].code == PIMA15740_EVENT_UNREPORTED_STATUS)
+			return 1;
 
-done:
-	free(recv_buf);
-	free(send_buf);
-	pthread_exit(NULL);
+	event_queue[event_count].code = PIMA15740_EVENT_UNREPORTED_STATUS;
+	event_queue[event_count].param = 0;
+	event_queue[event_count].id = 0;
+	event_count++;
+
+	fprintf(stderr, "Event queue overflow\n");
+	return 1;
 }
 
-static int start_io(void)
+/* @id is the transaction, which has caused the event, 0 if none */
+static void event_post_id(enum pima15740_event_code code, uint32_t param, uint32_t id)
 {
-	int ret;
-	char buf[256];
-
-	if (verbose)
-		fprintf(stderr, "Start bulk EPs\n");
+	struct ptp_event *ev;
+	unsigned int i;
 
-	if (bulk_in >= 0 && bulk_out >= 0)
-		return 0;
+	pthread_mutex_lock(&event_lock);
 
-	snprintf(buf, sizeof(buf), "/dev/gadget/%s", EP_IN_NAME);
-	bulk_in = source_open(buf);
-	if (bulk_in < 0)
-		return bulk_in;
+	/* No session, nobody to tell */
+	if (!event_running || session <= 0)
+		goto unlock;
 
-	snprintf(buf, sizeof(buf), "/dev/gadget/%s", EP_OUT_NAME);
-	bulk_out = sink_open(buf);
-	if (bulk_out < 0)
-		return bulk_out;
+	for (i = 0; i < event_count; i++) {
+		ev = &event_queue[i];
 
-	snprintf(buf, sizeof(buf), "/dev/gadget/%s", EP_STATUS_NAME);
-	interrupt = int_open(buf);
-	if (interrupt < 0)
-		return interrupt;
+		/* The host will have to re-read everything anyway */
+		if (ev->code == PIMA15740_EVENT_UNREPORTED_STATUS && event_is_object(code))
+			goto unlock;
 
-	status = PTP_IDLE;
+		if (ev->code == code && ev->param == param && ev->id == id)
+			goto unlock;
 
-	ret = pthread_create(&bulk_pthread, NULL, bulk_thread, NULL);
-	if (ret < 0) {
-		perror ("can't create bulk thread");
-		return ret;
+		/* The host has never seen this object */
+		if (code == PIMA15740_EVENT_OBJECT_REMOVED &&
+		    ev->code == PIMA15740_EVENT_OBJECT_ADDED && ev->param == param) {
+			ev->code = PIMA15740_EVENT_UNDEFINED;
+			goto unlock;
+		}
 	}
 
-	return 0;
-}
+	/* Object events are covered by UnreportedStatus, others dropped if still full */
+	if (event_overflow() &&
+	    (event_is_object(code) || event_count >= EVENT_QUEUE_LEN - 1))
+		goto unlock;
 
-static void stop_io(void)
-{
-	fprintf(stderr, "Stop bulk EPs\n");
+	ev = &event_queue[event_count++];
+	ev->code = code;
+	ev->param = param;
+	ev->id = id;
+	pthread_cond_signal(&event_cond);
 
-	if (bulk_in < 0 || bulk_out < 0)
-		return;
+unlock:
+	pthread_mutex_unlock(&event_lock);
+}
 
-	pthread_cancel(bulk_pthread);
-	pthread_join(bulk_pthread, NULL);
+static void event_post(enum pima15740_event_code code, uint32_t param)
+{
+	event_post_id(code, param, 0);
+}
 
-	status = PTP_WAITCONFIG;
+/* UnreportedStatus and CaptureComplete are sent without a parameter */
+static int event_has_param(uint16_t code)
+{
+	return code != PIMA15740_EVENT_UNREPORTED_STATUS &&
+		code != PIMA15740_EVENT_CAPTURE_COMPLETE;
+}
 
-	close(bulk_out);
-	bulk_out = -EINVAL;
-	close(bulk_in);
-	bulk_in = -EINVAL;
-	close(interrupt);
-	interrupt = -EINVAL;
+static void event_unlock(void *param)
+{
+	pthread_mutex_unlock(&event_lock);
 }
 
-static int reset_interface(void)
+static void *event_thread(void *param)
 {
-	/* just reset toggle/halt for the interface's endpoints */
-	int err;
+	static struct ptp_event batch[EVENT_QUEUE_LEN];
+	struct ptp_event_container c;
+	unsigned int i, n;
+	int ret;
 
-	if (status == PTP_WAITCONFIG)
-		return 0;
+	c.type	= __cpu_to_le16(PTP_CONTAINER_TYPE_EVENT_BLOCK);
 
-	sem_init(&reset, 0, 0);
+	for (;;) {
+		pthread_mutex_lock(&event_lock);
+		pthread_cleanup_push(event_unlock, NULL);
+		while (!event_count)
+			pthread_cond_wait(&event_cond, &event_lock);
+		pthread_cleanup_pop(1);
 
-	pthread_kill(bulk_pthread, SIGINT);
+		/* Let a burst accumulate, so that it can be coalesced */
+		usleep(EVENT_COALESCE_MS * 1000);
 
-	err = ioctl(bulk_in, GADGETFS_CLEAR_HALT);
-	if (err < 0)
-		perror("reset source fd");
+		pthread_mutex_lock(&event_lock);
+		n = event_count;
+		memcpy(batch, event_queue, n * sizeof(*batch));
+		event_count = 0;
+		pthread_mutex_unlock(&event_lock);
 
-	err = ioctl(bulk_out, GADGETFS_CLEAR_HALT);
-	if (err < 0)
-		perror("reset sink fd");
+		for (i = 0; i < n; i++) {
+			if (batch[i].code == PIMA15740_EVENT_UNDEFINED)
+				continue;
 
-	sem_post(&reset);
+			c.code	= __cpu_to_le16(batch[i].code);
+			c.id	= __cpu_to_le32(batch[i].id);
+			c.param	= __cpu_to_le32(batch[i].param);
+			c.length = __cpu_to_le32(event_has_param(batch[i].code) ? sizeof(c) :
+						 offsetof(struct ptp_event_container, param));
 
-	/* FIXME eventually reset the status endpoint too */
+			do {
+				ret = write(interrupt, &c, __le32_to_cpu(c.length));
+			} while (ret < 0 && errno == EINTR);
 
-	/* Always return "success"... */
-	return 0;
+			if (ret < 0) {
+				/* Disconnected or reset, the host will re-read state */
+				if (verbose)
+					fprintf(stderr, "Event 0x%x: %s\n",
+						batch[i].code, strerror(errno));
+				break;
+			}
+
+			if (verbose > 1)
+				fprintf(stderr, "Event 0x%x param 0x%x\n",
+					batch[i].code, batch[i].param);
+		}
+	}
+
+	return NULL;
 }
 
-static void handle_control(struct usb_ctrlrequest *setup)
+static int event_start(void)
 {
-	int		err, tmp;
-	uint8_t		buf[256];
-	uint16_t	value, index, length;
+	int ret;
 
-	value = __le16_to_cpu(setup->wValue);
-	index = __le16_to_cpu(setup->wIndex);
-	length = __le16_to_cpu(setup->wLength);
+	pthread_mutex_lock(&event_lock);
+	event_count = 0;
+	event_running = 1;
+	pthread_mutex_unlock(&event_lock);
 
-	if (verbose)
-		fprintf(stderr, "SETUP %02x.%02x "
-				"v%04x i%04x %d\n",
-			setup->bRequestType, setup->bRequest,
-			value, index, length);
+	ret = pthread_create(&event_pthread, NULL, event_thread, NULL);
+	if (ret) {
+		errno = ret;
+		perror("can't create event thread");
+		event_running = 0;
+		return -1;
+	}
 
-	/*
-	if ((setup->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD)
+	return 0;
+}
+
+static void event_stop(void)
+{
+	pthread_mutex_lock(&event_lock);
+	if (!event_running) {
+		pthread_mutex_unlock(&event_lock);
+		return;
+	}
+	event_running = 0;
+	event_count = 0;
+	pthread_mutex_unlock(&event_lock);
+
+	pthread_cancel(event_pthread);
+	pthread_join(event_pthread, NULL);
+}
+
+static int send_object_handles(void *recv_buf, void *send_buf, size_t send_len)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	enum pima15740_response_code code;
+	struct object_filter filter;
+	unsigned long length;
+	uint32_t *param;
+	int ret;
+	uint32_t *handle, h, n;
+	uint32_t format, association;
+
+	length	= __le32_to_cpu(r_container->length);
+
+	param = (uint32_t *)r_container->payload;
+
+	format = __le32_to_cpu(*(param + 1));
+	if (length > 16 && format != PTP_PARAM_UNUSED && format != PTP_PARAM_ANY) {
+		make_response(s_container, r_container,
+			      PIMA15740_RESP_SPECIFICATION_BY_FORMAT_NOT_SUPPORTED,
+			      sizeof(*s_container));
+		return 0;
+	}
+
+	association = length > 20 ? __le32_to_cpu(*(param + 2)) : PTP_PARAM_UNUSED;
+	code = object_filter_init(&filter, __le32_to_cpu(*param), association);
+	if (code != PIMA15740_RESP_OK) {
+		make_response(s_container, r_container, code, sizeof(*s_container));
+		return 0;
+	}
+
+	for (n = 0; object_filter_next(&filter); n++)
+		;
+
+	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
+	*(uint32_t *)s_container->payload = __cpu_to_le32(n);
+	s_container->length = __cpu_to_le32((n + 1) * sizeof(uint32_t) +
+					    sizeof(*s_container));
+
+	handle = (uint32_t *)s_container->payload + 1;
+
+	object_filter_init(&filter, __le32_to_cpu(*param), association);
+	while ((h = object_filter_next(&filter))) {
+		if ((void *)handle == send_buf + send_len) {
+			ret = engine_write(send_buf, send_len);
+			if (ret < 0) {
+				errno = EPIPE;
+				return ret;
+			}
+			handle = send_buf;
+		}
+
+		*handle++ = __cpu_to_le32(h);
+	}
+	if ((void *)handle > send_buf) {
+		ret = engine_write(send_buf, (void *)handle - send_buf);
+		if (ret < 0) {
+			errno = EPIPE;
+			return ret;
+		}
+	}
+
+	/* Prepare response */
+	make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+
+	return 0;
+}
+
+static int send_association(int n, struct ptp_container *s, size_t size)
+{
+	struct ptp_object_info *objinfo = (struct ptp_object_info *)s->payload;
+	size_t len, total;
+	int ret;
+
+	s->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
+	memcpy(objinfo, &association, sizeof(association));
+	objinfo->object_compressed_size = __cpu_to_le32(size);
+	switch (n) {
+	case 1:
+		len = strlen("DCIM") + 1;
+		ret = put_string(ic, (char *)objinfo->strings + 1, "DCIM", len);
+		objinfo->parent_object = __cpu_to_le32(0);
+		break;
+	case 2:
+		len = strlen(PTP_MODEL_DIR) + 1;
+		ret = put_string(ic, (char *)objinfo->strings + 1, PTP_MODEL_DIR, len);
+		objinfo->parent_object = __cpu_to_le32(1);
+		break;
+	}
+	if (ret < 0)
+		return ret;
+	objinfo->strings[0] = len;
+	objinfo->strings[2 * len + 1] = 0;	/* Empty Capture Date */
+	objinfo->strings[2 * len + 2] = 0;	/* Empty Modification Date */
+	objinfo->strings[2 * len + 3] = 0;	/* Empty Keywords */
+	total = 2 * len + 4 + sizeof(*s) + sizeof(*objinfo);
+	s->length = __cpu_to_le32(total);
+
+	return engine_write(s, total);
+}
+
+static int send_object_info(void *recv_buf, void *send_buf, size_t send_len)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	uint32_t *param;
+	struct obj_list *obj;
+	int ret;
+	uint32_t handle;
+	size_t count, total, offset;
+	void *info;
+	enum pima15740_response_code code = PIMA15740_RESP_OK;
+
+	param = (uint32_t *)r_container->payload;
+	handle = __le32_to_cpu(*param);
+
+	if (handle == 1 || handle == 2) {
+		struct stat dstat;
+		size_t size;
+
+		/* Directory information requested */
+		if (handle == 2) {
+			ret = fstat(root_fd, &dstat);
+			if (ret < 0) {
+				errno = EPIPE;
+				return ret;
+			}
+			size = dstat.st_size;
+			if (verbose > 1)
+				fprintf(stderr, "%s size %u\n", root, size);
+		} else
+			size = 4096;
+		ret = send_association(handle, s_container, size);
+		if (ret < 0) {
+			errno = EPIPE;
+			return ret;
+		}
+
+		goto send_resp;
+	}
+
+	for (obj = images; obj; obj = obj->next)
+		if (obj->handle == handle)
+			break;
+
+	if (!obj) {
+		code = PIMA15740_RESP_INVALID_OBJECT_HANDLE;
+		goto send_resp;
+	}
+
+	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
+	total = obj->info_size + sizeof(*s_container);
+	s_container->length = __cpu_to_le32(total);
+	offset = sizeof(*s_container);
+	info = &obj->info;
+
+	/* Object Info cannot get > 4096 bytes - four strings make a maximum of 2048
+	 * bytes plus a fixed-size block, but we play safe for the case someone
+	 * makes the buffers smaller */
+
+	while (total) {
+		count = min(total, send_len);
+		memcpy(send_buf + offset, info, count - offset);
+		info += count - offset;
+		ret = engine_write(send_buf, count);
+		if (ret < 0) {
+			errno = EPIPE;
+			return ret;
+		}
+		offset = 0;
+		total -= count;
+	}
+
+send_resp:
+	/* Prepare response */
+	make_response(s_container, r_container, code, sizeof(*s_container));
+
+	return 0;
+}
+
+/*
+ * Open object cache: the last OPEN_CACHE_SLOTS objects read keep their file
+ * descriptor, and their mapping once one has been needed, so that repeated
+ * and partial reads of the same object skip open() and mmap(). Only used by
+ * the bulk thread, entries are dropped when their object is deleted. Objects
+ * are mapped in windows of at most MMAP_WINDOW bytes, so that any object size
+ * fits into a 32-bit address space.
+ */
+#define OPEN_CACHE_SLOTS	8
+#define MMAP_WINDOW		(16 * 1024 * 1024)
+
+struct open_object {
+	uint32_t	handle;		/* 0 for a free slot */
+	int		fd;
+	void		*map;
+	uint64_t	map_offset;
+	size_t		map_len;
+	uint64_t	size;
+	unsigned long	used;
+};
+
+static struct open_object open_cache[OPEN_CACHE_SLOTS];
+static unsigned long open_clock;
+
+static void open_object_release(struct open_object *o)
+{
+	if (o->map)
+		munmap(o->map, o->map_len);
+	if (o->handle)
+		close(o->fd);
+	memset(o, 0, sizeof(*o));
+}
+
+static struct open_object *open_object_get(struct obj_list *obj)
+{
+	struct open_object *o, *victim = open_cache;
+	int fd;
+
+	for (o = open_cache; o < open_cache + OPEN_CACHE_SLOTS; o++) {
+		if (o->handle == obj->handle)
+			goto found;
+		if (o->used < victim->used)
+			victim = o;
+	}
+
+	if (obj->mem_fd >= 0)
+		fd = fcntl(obj->mem_fd, F_DUPFD_CLOEXEC, 0);
+	else
+		fd = openat(root_fd, obj->name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	o = victim;
+	open_object_release(o);
+	o->handle	= obj->handle;
+	o->fd		= fd;
+	o->size		= obj->size;
+found:
+	o->used = ++open_clock;
+	return o;
+}
+
+/* Map a window with the len bytes from offset, or up to the end of the object */
+static void *open_object_map(struct open_object *o, uint64_t offset, size_t len)
+{
+	uint64_t start = offset & ~((uint64_t)sysconf(_SC_PAGESIZE) - 1);
+
+	if (offset >= o->size)
+		return NULL;
+
+	len = min((uint64_t)len, o->size - offset);
+	if (!o->map || offset < o->map_offset ||
+	    offset + len > o->map_offset + o->map_len) {
+		if (o->map)
+			munmap(o->map, o->map_len);
+		o->map_offset	= start;
+		o->map_len	= min(o->size - start, (uint64_t)MMAP_WINDOW);
+		o->map = mmap(NULL, o->map_len, PROT_READ, MAP_SHARED, o->fd, start);
+		if (o->map == MAP_FAILED) {
+			o->map = NULL;
+			return NULL;
+		}
+	}
+
+	return o->map + (offset - o->map_offset);
+}
+
+static void open_cache_invalidate(uint32_t handle)
+{
+	int i;
+
+	for (i = 0; i < OPEN_CACHE_SLOTS; i++)
+		if (open_cache[i].handle == handle)
+			open_object_release(open_cache + i);
+}
+
+/*
+ * io_uring data path: the file is read in URING_CHUNK pieces into two
+ * registered buffers, the next read is kept in flight while the current
+ * chunk is written to the bulk-in endpoint. The first chunk is preceded by
+ * the container header, for which space is reserved in each buffer.
+ */
+static int uring_queue_read(int fd, int idx, uint64_t offset, size_t len)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&data_ring);
+
+	if (!sqe)
+		return -EBUSY;
+
+	uring_prep_read_fixed(sqe, fd, uring_buf[idx] + sizeof(struct ptp_container),
+			      len, offset, idx, idx);
+	return 0;
+}
+
+static int uring_wait_read(size_t len)
+{
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	/* Submits a queued read and waits for it with one system call */
+	while (!(cqe = uring_peek_cqe(&data_ring))) {
+		ret = uring_submit(&data_ring, 1);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = cqe->res;
+	uring_cqe_seen(&data_ring);
+
+	/* The file has been truncated under us */
+	if (ret >= 0 && ret != len)
+		ret = -EIO;
+
+	return ret;
+}
+
+/* All return 1 if nothing has been sent yet, and a response can still be sent */
+static int send_file_uring(int fd, struct ptp_container *s_container, uint64_t offset,
+			   uint64_t file_size)
+{
+	uint64_t pos = 0;
+	size_t len, next;
+	int idx = 0, ret;
+	void *buf;
+
+	/*
+	 * Only the last write of a data phase may end in a short packet, so the
+	 * first chunk is shortened by the header: all writes but the last are
+	 * URING_CHUNK bytes.
+	 */
+	len = min(file_size, (uint64_t)(URING_CHUNK - sizeof(*s_container)));
+	ret = uring_queue_read(fd, idx, offset, len);
+	if (ret < 0)
+		return 1;
+
+	do {
+		ret = uring_wait_read(len);
+		if (ret < 0)
+			goto fail;
+
+		next = min(file_size - pos - len, (uint64_t)URING_CHUNK);
+		if (next) {
+			ret = uring_queue_read(fd, !idx, offset + pos + len, next);
+			if (!ret)
+				ret = uring_submit(&data_ring, 0);
+			if (ret < 0)
+				goto fail;
+		}
+
+		buf = uring_buf[idx] + sizeof(*s_container);
+		if (!pos) {
+			buf -= sizeof(*s_container);
+			memcpy(buf, s_container, sizeof(*s_container));
+			ret = engine_write(buf, len + sizeof(*s_container));
+		} else {
+			ret = engine_write(buf, len);
+		}
+		if (ret < 0)
+			goto out;
+
+		pos += len;
+		len = next;
+		idx = !idx;
+	} while (len);
+
+	return 0;
+
+fail:
+	/* Before the first write a response can still be sent */
+	if (!pos)
+		ret = 1;
+out:
+	/* Don't leave a read targeting our buffers behind */
+	uring_drain(&data_ring);
+	return ret;
+}
+
+static int send_file_mmap(struct open_object *o, void *send_buf, size_t send_len,
+			  uint64_t offset, uint64_t file_size)
+{
+	size_t count, header = sizeof(struct ptp_container);
+	uint64_t end = offset + file_size;
+	void *data;
+	int ret;
+
+	/* The header goes out together with the beginning of the data */
+	count = min(file_size, (uint64_t)(send_len - header));
+	if (count) {
+		data = open_object_map(o, offset, count);
+		if (!data)
+			return 1;
+		memcpy(send_buf + header, data, count);
+	}
+	ret = engine_write(send_buf, count + header);
+	if (ret < 0)
+		return ret;
+	offset += count;
+	/* Like the io_uring path, a multiple of any burst */
+	send_len = URING_CHUNK;
+
+	/* Full send_len writes, only the last one may be short */
+	while (offset < end) {
+		count = min(end - offset, (uint64_t)send_len);
+		data = open_object_map(o, offset, count);
+		if (!data)
+			return -1;
+		ret = engine_write(data, count);
+		if (ret < 0)
+			return ret;
+		offset += count;
+	}
+
+	return 0;
+}
+
+/* Objects up to PREAD_MAX are sent with one pread() and one write() */
+#define PREAD_MAX	(64 * 1024)
+
+static int send_file_pread(int fd, struct ptp_container *s_container, size_t offset,
+			   size_t file_size)
+{
+	size_t count = 0;
+	ssize_t ret = 0;
+	uint8_t *buf;
+
+	buf = xfer_get();
+	if (!buf)
+		return 1;
+
+	pthread_cleanup_push(xfer_put, buf);
+
+	memcpy(buf, s_container, sizeof(*s_container));
+
+	while (count < file_size) {
+		ret = pread(fd, buf + sizeof(*s_container) + count, file_size - count,
+			    offset + count);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			ret = 1;
+			break;
+		}
+		count += ret;
+	}
+
+	if (count == file_size) {
+		ret = engine_write(buf, sizeof(*s_container) + file_size);
+		if (ret > 0)
+			ret = 0;
+	}
+
+	pthread_cleanup_pop(1);
+
+	return ret;
+}
+
+/* Thumbnails are called <basename>.thumb.jpeg, relative to thumb_fd */
+static int thumb_name(char *buf, size_t size, const char *name)
+{
+	const char *dot = strrchr(name, '.');
+
+	if (!dot || dot == name)
+		return -1;
+
+	snprintf(buf, size, "%.*s.thumb.jpeg", (int)(dot - name), name);
+	return 0;
+}
+
+/*
+ * Packed thumbnail store: all thumbnails are appended to one file under
+ * THUMB_LOCATION, each behind a record header, and served from a mapping of
+ * that file. Thumbnails are keyed by a hash of the image contents, so renamed
+ * and copied images share one. Identity records map device, inode, size and
+ * modification time of an image to its content hash, so that unchanged images
+ * need not be read at startup. Thumbnails, which no image refers to any more,
+ * and their identities are dropped by compaction at startup, once more than
+ * half of the pack or more than THUMB_PACK_GARBAGE bytes of it are garbage.
+ *
+ * Several processes may share the pack: each holds THUMB_PACK_LOCK shared
+ * while it runs, exclusively only during a startup, on which it finds the
+ * pack unused, so that only a sole user compacts. Appends are serialised by
+ * a lock on the pack itself, each process picks up the records of the others
+ * before appending its own, so that a thumbnail is only ever made once.
+ */
+#define THUMB_PACK		"thumbs.pack"
+#define THUMB_PACK_TMP		"thumbs.pack.tmp"
+#define THUMB_PACK_LOCK		"thumbs.lock"
+#define THUMB_PACK_GARBAGE	(32 * 1024 * 1024)
+#define THUMB_PACK_MAGIC	0x4b505450	/* "PTPK" */
+#define THUMB_PACK_HASH		1024
+
+/* Host endian, the pack never leaves the device */
+struct pack_rec {
+	uint32_t	magic;
+	uint32_t	len;		/* thumbnail data following, 0 for identity only */
+	uint64_t	hash;		/* of the image contents */
+	uint64_t	dev;		/* identity of the image, 0 if none */
+	uint64_t	ino;
+	uint64_t	size;
+	int64_t		mtime;
+} __attribute__ ((packed));
+
+struct pack_thumb {
+	struct pack_thumb	*next;
+	uint64_t		hash;
+	off_t			offset;		/* of the thumbnail data */
+	uint32_t		len;
+	int			refs;		/* images using it */
+};
+
+struct pack_id {
+	struct pack_id		*next;
+	uint64_t		dev, ino, size;
+	int64_t			mtime;
+	uint64_t		hash;
+};
+
+static struct pack_thumb *pack_thumbs[THUMB_PACK_HASH];
+static struct pack_id *pack_ids[THUMB_PACK_HASH];
+static int pack_fd = -1, pack_lock_fd = -1;
+/* Another process uses the pack too, it must not be replaced */
+static int pack_shared;
+static off_t pack_end;
+static void *pack_map;
+static size_t pack_map_size;
+static pthread_mutex_t pack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct pack_thumb *pack_find(uint64_t hash)
+{
+	struct pack_thumb *t;
+
+	for (t = pack_thumbs[hash % THUMB_PACK_HASH]; t; t = t->next)
+		if (t->hash == hash)
+			break;
+
+	return t;
+}
+
+static uint64_t pack_find_id(const struct pack_rec *rec)
+{
+	struct pack_id *id;
+
+	for (id = pack_ids[rec->ino % THUMB_PACK_HASH]; id; id = id->next)
+		if (id->ino == rec->ino && id->dev == rec->dev &&
+		    id->size == rec->size && id->mtime == rec->mtime)
+			return id->hash;
+
+	return 0;
+}
+
+/* Enter a record found at offset into the index */
+static int pack_index(const struct pack_rec *rec, off_t offset)
+{
+	struct pack_thumb *t;
+	struct pack_id *id;
+
+	if (rec->len && !pack_find(rec->hash)) {
+		t = malloc(sizeof(*t));
+		if (!t)
+			return -1;
+		t->hash		= rec->hash;
+		t->offset	= offset + sizeof(*rec);
+		t->len		= rec->len;
+		t->refs		= 0;
+		t->next		= pack_thumbs[t->hash % THUMB_PACK_HASH];
+		pack_thumbs[t->hash % THUMB_PACK_HASH] = t;
+	}
+
+	if (rec->ino && !pack_find_id(rec)) {
+		id = malloc(sizeof(*id));
+		if (!id)
+			return -1;
+		id->dev		= rec->dev;
+		id->ino		= rec->ino;
+		id->size	= rec->size;
+		id->mtime	= rec->mtime;
+		id->hash	= rec->hash;
+		id->next	= pack_ids[id->ino % THUMB_PACK_HASH];
+		pack_ids[id->ino % THUMB_PACK_HASH] = id;
+	}
+
+	return 0;
+}
+
+static void pack_free_index(void)
+{
+	struct pack_thumb *t;
+	struct pack_id *id;
+	int i;
+
+	for (i = 0; i < THUMB_PACK_HASH; i++) {
+		while ((t = pack_thumbs[i])) {
+			pack_thumbs[i] = t->next;
+			free(t);
+		}
+		while ((id = pack_ids[i])) {
+			pack_ids[i] = id->next;
+			free(id);
+		}
+	}
+}
+
+/* Index the records from pack_end on, a torn record at the end is cut off */
+static int pack_scan(void)
+{
+	struct pack_rec rec;
+	struct stat st;
+	off_t offset = pack_end;
+	ssize_t ret;
+
+	if (fstat(pack_fd, &st) < 0)
+		return -1;
+
+	while (offset < st.st_size) {
+		ret = pread(pack_fd, &rec, sizeof(rec), offset);
+		if (ret != sizeof(rec) || rec.magic != THUMB_PACK_MAGIC ||
+		    !rec.hash || offset + sizeof(rec) + rec.len > st.st_size)
+			break;
+		if (pack_index(&rec, offset) < 0)
+			return -1;
+		offset += sizeof(rec) + rec.len;
+	}
+
+	if (offset < st.st_size) {
+		fprintf(stderr, "Thumbnail pack damaged at %lld, truncating\n",
+			(long long)offset);
+		if (ftruncate(pack_fd, offset) < 0)
+			return -1;
+	}
+	pack_end = offset;
+
+	return 0;
+}
+
+static int pack_open(void)
+{
+	int ret;
+
+	if (thumb_fd < 0)
+		return -1;
+
+	/* Waits for another process to finish compacting */
+	pack_lock_fd = openat(thumb_fd, THUMB_PACK_LOCK, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (pack_lock_fd >= 0 && flock(pack_lock_fd, LOCK_EX | LOCK_NB) < 0) {
+		pack_shared = 1;
+		if (flock(pack_lock_fd, LOCK_SH) < 0)
+			perror("Cannot lock " THUMB_LOCATION THUMB_PACK_LOCK);
+		if (verbose)
+			fprintf(stderr, "Thumbnail pack shared with another process\n");
+	}
+
+	pack_fd = openat(thumb_fd, THUMB_PACK, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (pack_fd < 0) {
+		fprintf(stderr, "Cannot open " THUMB_LOCATION THUMB_PACK ": %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	flock(pack_fd, LOCK_EX);
+	ret = pack_scan();
+	flock(pack_fd, LOCK_UN);
+	if (ret < 0) {
+		perror("Cannot read " THUMB_LOCATION THUMB_PACK);
+		close(pack_fd);
+		pack_fd = -1;
+		return -1;
+	}
+
+	if (verbose)
+		fprintf(stderr, "Thumbnail pack: %lld bytes\n", (long long)pack_end);
+
+	return 0;
+}
+
+/* Append a record with len bytes of thumbnail data, or an identity record */
+static int pack_append(struct pack_rec *rec, const void *data)
+{
+	struct iovec iov[2] = {
+		{ .iov_base = rec,		.iov_len = sizeof(*rec), },
+		{ .iov_base = (void *)data,	.iov_len = rec->len, },
+	};
+	ssize_t ret;
+
+	if (pack_fd < 0)
+		return -1;
+
+	if (pack_shared) {
+		flock(pack_fd, LOCK_EX);
+		/* Records of the other processes, the thumbnail may be among them */
+		ret = pack_scan();
+		if (!ret && rec->len && pack_find(rec->hash))
+			goto unlock;
+	}
+
+	rec->magic = THUMB_PACK_MAGIC;
+	ret = pwritev(pack_fd, iov, rec->len ? 2 : 1, pack_end);
+	if (ret != sizeof(*rec) + rec->len) {
+		fprintf(stderr, "Cannot write " THUMB_LOCATION THUMB_PACK ": %s\n",
+			ret < 0 ? strerror(errno) : "short write");
+		/* Don't leave a partial record behind */
+		if (ret > 0 && ftruncate(pack_fd, pack_end) < 0)
+			perror("Cannot truncate " THUMB_LOCATION THUMB_PACK);
+		ret = -1;
+		goto unlock;
+	}
+
+	ret = pack_index(rec, pack_end);
+	pack_end += sizeof(*rec) + rec->len;
+
+unlock:
+	if (pack_shared)
+		flock(pack_fd, LOCK_UN);
+	return ret;
+}
+
+/* Startup is over, other processes may use the pack from now on */
+static void pack_share(void)
+{
+	if (pack_lock_fd >= 0 && !pack_shared)
+		flock(pack_lock_fd, LOCK_SH);
+	pack_shared = 1;
+}
+
+/* Copy a thumbnail out of the pack, remapping it if it has grown */
+static int pack_read(uint64_t hash, void *buf, size_t len)
+{
+	struct pack_thumb *t;
+	int ret = -1;
+
+	pthread_mutex_lock(&pack_lock);
+
+	t = pack_find(hash);
+	if (!t || t->len != len)
+		goto unlock;
+
+	if (t->offset + len > pack_map_size) {
+		if (pack_map)
+			munmap(pack_map, pack_map_size);
+		pack_map_size = pack_end;
+		pack_map = mmap(NULL, pack_map_size, PROT_READ, MAP_SHARED, pack_fd, 0);
+		if (pack_map == MAP_FAILED) {
+			pack_map = NULL;
+			pack_map_size = 0;
+			goto unlock;
+		}
+	}
+
+	memcpy(buf, pack_map + t->offset, len);
+	ret = 0;
+
+unlock:
+	pthread_mutex_unlock(&pack_lock);
+	return ret;
+}
+
+/* An image using the thumbnail has gone, the space is reclaimed by compaction */
+static void pack_put(uint64_t hash)
+{
+	struct pack_thumb *t;
+
+	pthread_mutex_lock(&pack_lock);
+	t = pack_find(hash);
+	if (t && t->refs)
+		t->refs--;
+	pthread_mutex_unlock(&pack_lock);
+}
+
+/*
+ * Write referenced thumbnails and their identities to a new pack, which then
+ * replaces the old one. Called at startup, once all images are known.
+ */
+static void pack_compact(void)
+{
+	struct pack_thumb *t;
+	struct pack_id *id;
+	struct pack_rec rec;
+	struct obj_list *obj;
+	unsigned long long live = 0, garbage;
+	void *buf = NULL;
+	off_t offset = 0;
+	int i, fd;
+
+	if (pack_fd < 0 || pack_shared)
+		return;
+
+	/*
+	 * What compaction would keep: referenced thumbnails and their identities,
+	 * each in a record of its own. Appended records carry both, the estimate
+	 * may exceed the pack then.
+	 */
+	for (i = 0; i < THUMB_PACK_HASH; i++) {
+		for (t = pack_thumbs[i]; t; t = t->next)
+			if (t->refs)
+				live += sizeof(rec) + t->len;
+		for (id = pack_ids[i]; id; id = id->next)
+			if ((t = pack_find(id->hash)) && t->refs)
+				live += sizeof(rec);
+	}
+
+	garbage = pack_end > live ? pack_end - live : 0;
+	if (garbage <= pack_end / 2 && garbage <= THUMB_PACK_GARBAGE)
+		return;
+
+	if (verbose)
+		fprintf(stderr, "Compacting thumbnail pack: %lld of %lld bytes in use\n",
+			live, (long long)pack_end);
+
+	fd = openat(thumb_fd, THUMB_PACK_TMP, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		perror("Cannot create " THUMB_LOCATION THUMB_PACK_TMP);
+		return;
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	rec.magic = THUMB_PACK_MAGIC;
+
+	for (i = 0; i < THUMB_PACK_HASH; i++)
+		for (t = pack_thumbs[i]; t; t = t->next) {
+			void *tmp;
+
+			if (!t->refs)
+				continue;
+
+			tmp = realloc(buf, t->len);
+			if (!tmp)
+				goto err;
+			buf = tmp;
+
+			rec.len = t->len;
+			rec.hash = t->hash;
+			if (pread(pack_fd, buf, t->len, t->offset) != t->len ||
+			    pwrite(fd, &rec, sizeof(rec), offset) != sizeof(rec) ||
+			    pwrite(fd, buf, t->len, offset + sizeof(rec)) != t->len)
+				goto err;
+			offset += sizeof(rec) + t->len;
+		}
+
+	/* Identities of images, which have been deleted, go too */
+	rec.len = 0;
+	for (i = 0; i < THUMB_PACK_HASH; i++)
+		for (id = pack_ids[i]; id; id = id->next) {
+			t = pack_find(id->hash);
+			if (!t || !t->refs)
+				continue;
+
+			rec.hash	= id->hash;
+			rec.dev		= id->dev;
+			rec.ino		= id->ino;
+			rec.size	= id->size;
+			rec.mtime	= id->mtime;
+			if (pwrite(fd, &rec, sizeof(rec), offset) != sizeof(rec))
+				goto err;
+			offset += sizeof(rec);
+		}
+
+	if (fsync(fd) < 0 || renameat(thumb_fd, THUMB_PACK_TMP, thumb_fd, THUMB_PACK) < 0)
+		goto err;
+
+	free(buf);
+	close(pack_fd);
+	pack_fd = fd;
+	pack_free_index();
+	pack_end = 0;
+	if (pack_map) {
+		munmap(pack_map, pack_map_size);
+		pack_map = NULL;
+		pack_map_size = 0;
+	}
+	if (pack_scan() < 0) {
+		perror("Cannot read " THUMB_LOCATION THUMB_PACK);
+		close(pack_fd);
+		pack_fd = -1;
+		return;
+	}
+
+	/* References are not stored in the pack */
+	for (obj = images; obj; obj = obj->next)
+		if (obj->thumb_hash && (t = pack_find(obj->thumb_hash)))
+			t->refs++;
+
+	return;
+
+err:
+	perror("Cannot compact " THUMB_LOCATION THUMB_PACK);
+	free(buf);
+	close(fd);
+	unlinkat(thumb_fd, THUMB_PACK_TMP, 0);
+}
+
+/*
+ * Persistent handles: an image keeps its object handle across restarts as long
+ * as its inode and name stay the same, so that hosts can keep what they have
+ * cached. Handles are never reused: new images get theirs from a high-water
+ * mark, which only starts over in a new generation, once the 32-bit handle
+ * space is used up. The map is rewritten whenever images have come or gone,
+ * into a temporary file, which is synced and renamed over the map.
+ *
+ * Every image directory has a map of its own, named after a hash of its path,
+ * so that processes serving different directories, on different controllers,
+ * all keep their handles. A map is kept by the process, which holds the lock
+ * on its lock file; another one serving the same directory starts from the
+ * map, but doesn't write it. The map of older versions, HANDLE_MAP_OLD, is
+ * read by any directory, which doesn't have a map yet.
+ */
+#define HANDLE_LOCATION		"/var/cache/ptp/"
+#define HANDLE_MAP_OLD		"handles"
+#define HANDLE_MAP_MAGIC	0x48505450	/* "PTPH" */
+#define HANDLE_HASH		1024
+/* 1 and 2 are /DCIM and /DCIM/PTP_MODEL_DIR */
+#define HANDLE_FIRST		3
+
+/* Host endian, like the thumbnail pack */
+struct handle_map_hdr {
+	uint32_t	magic;
+	uint32_t	generation;
+	uint32_t	next;		/* next handle to assign */
+	uint32_t	count;		/* of records following */
+} __attribute__ ((packed));
+
+struct handle_map_rec {
+	uint64_t	ino;
+	uint32_t	handle;
+	uint16_t	name_len;	/* name following, without '\0' */
+} __attribute__ ((packed));
+
+struct handle_ent {
+	struct handle_ent	*next;		/* by inode and name */
+	struct handle_ent	*hnext;		/* by handle */
+	uint64_t		ino;
+	uint32_t		handle;
+	int			live;		/* found by the scan */
+	char			name[];
+};
+
+static struct handle_ent *handle_keys[HANDLE_HASH], *handle_ids[HANDLE_HASH];
+static uint32_t handle_generation = 1, handle_next = HANDLE_FIRST;
+static int handle_count, handle_dirty;
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t fnv1a(uint64_t h, const uint8_t *p, size_t len);
+
+/* HANDLE_LOCATION, -1 if handles are not kept */
+static int handle_fd = -1;
+/* handles.<hash of the root path>, its lock and temporary file */
+static char handle_map[32], handle_map_lock[40], handle_map_tmp[40];
+
+static unsigned int handle_key(uint64_t ino, const char *name)
+{
+	unsigned int h = ino;
+
+	while (*name)
+		h = h * 31 + *name++;
+
+	return h % HANDLE_HASH;
+}
+
+static struct handle_ent *handle_find(uint64_t ino, const char *name)
+{
+	struct handle_ent *h;
+
+	for (h = handle_keys[handle_key(ino, name)]; h; h = h->next)
+		if (h->ino == ino && !strcmp(h->name, name))
+			break;
+
+	return h;
+}
+
+static struct handle_ent *handle_add(uint64_t ino, uint32_t handle, const char *name, size_t len)
+{
+	struct handle_ent *h;
+	unsigned int k;
+
+	h = malloc(sizeof(*h) + len + 1);
+	if (!h)
+		return NULL;
+
+	h->ino		= ino;
+	h->handle	= handle;
+	h->live		= 0;
+	memcpy(h->name, name, len);
+	h->name[len]	= '\0';
+
+	k = handle_key(ino, h->name);
+	h->next = handle_keys[k];
+	handle_keys[k] = h;
+	h->hnext = handle_ids[handle % HANDLE_HASH];
+	handle_ids[handle % HANDLE_HASH] = h;
+	handle_count++;
+
+	return h;
+}
+
+static void handle_del(struct handle_ent *h)
+{
+	struct handle_ent **p;
+
+	for (p = &handle_keys[handle_key(h->ino, h->name)]; *p != h; p = &(*p)->next)
+		;
+	*p = h->next;
+	for (p = &handle_ids[h->handle % HANDLE_HASH]; *p != h; p = &(*p)->hnext)
+		;
+	*p = h->hnext;
+
+	handle_count--;
+	free(h);
+}
+
+static int handle_used(uint32_t handle)
+{
+	struct handle_ent *h;
+
+	for (h = handle_ids[handle % HANDLE_HASH]; h; h = h->hnext)
+		if (h->handle == handle)
+			return 1;
+
+	return 0;
+}
+
+/* Name the map after the directory, the same however it is given on the command line */
+static void handle_map_names(void)
+{
+	char *path = realpath(root, NULL);
+	const char *p = path ? path : root;
+	unsigned long long h;
+
+	h = fnv1a(0xcbf29ce484222325ULL, (const uint8_t *)p, strlen(p));
+	free(path);
+
+	snprintf(handle_map, sizeof(handle_map), "handles.%016llx", h);
+	snprintf(handle_map_lock, sizeof(handle_map_lock), "%s.lock", handle_map);
+	snprintf(handle_map_tmp, sizeof(handle_map_tmp), "%s.tmp", handle_map);
+}
+
+/* Read the map, a torn or corrupt tail is dropped */
+static void handles_load(void)
+{
+	struct handle_map_hdr hdr;
+	struct handle_map_rec rec;
+	const char *map;
+	char name[256];
+	FILE *f;
+	int fd, lock_fd, shared = 0;
+	uint32_t i;
+
+	handle_fd = open(HANDLE_LOCATION, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (handle_fd < 0) {
+		fprintf(stderr, "Cannot open %s: %s, handles will change on restart\n",
+			HANDLE_LOCATION, strerror(errno));
+		return;
+	}
+
+	handle_map_names();
+
+	/* Held until exit, the descriptor is never closed */
+	lock_fd = openat(handle_fd, handle_map_lock, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB) < 0) {
+		fprintf(stderr, "%s%s: %s, handles will change on restart\n",
+			HANDLE_LOCATION, handle_map_lock,
+			lock_fd < 0 ? strerror(errno) : "in use by another process");
+		if (lock_fd >= 0)
+			close(lock_fd);
+		shared = 1;
+	}
+
+	map = handle_map;
+	fd = openat(handle_fd, map, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 && errno == ENOENT) {
+		map = HANDLE_MAP_OLD;
+		fd = openat(handle_fd, map, O_RDONLY | O_CLOEXEC);
+	}
+	if (fd < 0 || !(f = fdopen(fd, "r"))) {
+		if (fd >= 0)
+			close(fd);
+		goto done;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != HANDLE_MAP_MAGIC) {
+		/* Nothing to go by, old handles may be handed out again */
+		fprintf(stderr, "Invalid %s%s, starting a new generation\n", HANDLE_LOCATION, map);
+		handle_dirty = 1;
+		goto out;
+	}
+
+	handle_generation = hdr.generation;
+	handle_next = hdr.next;
+
+	for (i = 0; i < hdr.count; i++) {
+		if (fread(&rec, sizeof(rec), 1, f) != 1 || rec.name_len >= sizeof(name) ||
+		    fread(name, 1, rec.name_len, f) != rec.name_len ||
+		    rec.handle < HANDLE_FIRST || handle_used(rec.handle))
+			break;
+		name[rec.name_len] = '\0';
+		if (!handle_add(rec.ino, rec.handle, name, rec.name_len))
+			break;
+	}
+
+	if (verbose)
+		fprintf(stderr, "Handle map %s: generation %u, %d handles, next %u\n",
+			map, handle_generation, handle_count, handle_next);
+
+	/* Carried over into the map of this directory */
+	if (map != handle_map)
+		handle_dirty = 1;
+
+out:
+	fclose(f);
+done:
+	if (shared) {
+		close(handle_fd);
+		handle_fd = -1;
+	}
+}
+
+/* The next handle, which has not been handed out in this generation */
+static uint32_t handle_alloc(void)
+{
+	uint32_t handle;
+
+	do {
+		handle = handle_next++;
+		if (handle_next == PTP_PARAM_ANY) {
+			/* Used up, handles of deleted images may come back now */
+			handle_generation++;
+			handle_next = HANDLE_FIRST;
+		}
+	} while (handle_used(handle));
+
+	handle_dirty = 1;
+
+	return handle;
+}
+
+/* A handle for an object, which only lives as long as the process */
+static uint32_t handle_new(void)
+{
+	uint32_t handle;
+
+	pthread_mutex_lock(&handle_lock);
+	handle = handle_alloc();
+	pthread_mutex_unlock(&handle_lock);
+
+	return handle;
+}
+
+/* Enumeration: the handle of an image, 0 if none can be assigned */
+static uint32_t handle_assign(uint64_t ino, const char *name)
+{
+	struct handle_ent *h;
+	uint32_t handle;
+
+	h = handle_find(ino, name);
+	if (h) {
+		h->live = 1;
+		return h->handle;
+	}
+
+	handle = handle_alloc();
+	h = handle_add(ino, handle, name, strlen(name));
+	if (!h)
+		return 0;
+
+	h->live = 1;
+	handle_dirty = 1;
+
+	return handle;
+}
+
+/* Enumeration is over: forget images, which are gone */
+static void handles_prune(void)
+{
+	struct handle_ent *h, *next;
+	int i;
+
+	for (i = 0; i < HANDLE_HASH; i++)
+		for (h = handle_keys[i]; h; h = next) {
+			next = h->next;
+			if (!h->live) {
+				handle_del(h);
+				handle_dirty = 1;
+			}
+		}
+}
+
+/* The object is being deleted */
+static void handle_forget(uint32_t handle)
+{
+	struct handle_ent *h;
+
+	pthread_mutex_lock(&handle_lock);
+	for (h = handle_ids[handle % HANDLE_HASH]; h; h = h->hnext)
+		if (h->handle == handle) {
+			handle_del(h);
+			handle_dirty = 1;
+			break;
+		}
+	pthread_mutex_unlock(&handle_lock);
+}
+
+static void handles_save(void)
+{
+	struct handle_map_hdr hdr;
+	struct handle_map_rec rec;
+	struct handle_ent *h;
+	FILE *f;
+	int fd, i;
+
+	pthread_mutex_lock(&handle_lock);
+
+	if (handle_fd < 0 || !handle_dirty)
+		goto unlock;
+
+	fd = openat(handle_fd, handle_map_tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0 || !(f = fdopen(fd, "w"))) {
+		if (fd >= 0)
+			close(fd);
+		goto err;
+	}
+
+	hdr.magic	= HANDLE_MAP_MAGIC;
+	hdr.generation	= handle_generation;
+	hdr.next	= handle_next;
+	hdr.count	= handle_count;
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	for (i = 0; i < HANDLE_HASH; i++)
+		for (h = handle_keys[i]; h; h = h->next) {
+			rec.ino		= h->ino;
+			rec.handle	= h->handle;
+			rec.name_len	= strlen(h->name);
+			fwrite(&rec, sizeof(rec), 1, f);
+			fwrite(h->name, 1, rec.name_len, f);
+		}
+
+	if (fflush(f) || ferror(f) || fsync(fd) < 0) {
+		fclose(f);
+		goto err;
+	}
+	fclose(f);
+
+	if (renameat(handle_fd, handle_map_tmp, handle_fd, handle_map) < 0)
+		goto err;
+	/* Make the rename durable too */
+	fsync(handle_fd);
+
+	handle_dirty = 0;
+	goto unlock;
+
+err:
+	fprintf(stderr, "Cannot write %s%s: %s\n", HANDLE_LOCATION, handle_map, strerror(errno));
+	unlinkat(handle_fd, handle_map_tmp, 0);
+unlock:
+	pthread_mutex_unlock(&handle_lock);
+}
+
+/*
+ * Thumbnail cache: ready-to-send data containers (header and JPEG data) of
+ * recently requested thumbnails, indexed by object handle and evicted in LRU
+ * order once THUMB_CACHE_SIZE is exceeded. Entries are reference counted, an
+ * evicted or invalidated entry is freed by its last user.
+ */
+#define THUMB_CACHE_SIZE	(4 * 1024 * 1024)
+#define THUMB_CACHE_HASH	256
+
+struct thumb_entry {
+	struct thumb_entry	*prev, *next;	/* LRU list, most recent first */
+	struct thumb_entry	*hash_next;
+	uint32_t		handle;
+	int			refs;
+	int			cached;
+	size_t			size;		/* container, including header */
+	uint8_t			data[];
+};
+
+static struct thumb_entry *thumb_hash[THUMB_CACHE_HASH];
+static struct thumb_entry thumb_lru = { .prev = &thumb_lru, .next = &thumb_lru, };
+static size_t thumb_cache_used;
+static pthread_mutex_t thumb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Called with thumb_lock held */
+static void thumb_cache_unlink(struct thumb_entry *t)
+{
+	struct thumb_entry **p = &thumb_hash[t->handle % THUMB_CACHE_HASH];
+
+	while (*p != t)
+		p = &(*p)->hash_next;
+	*p = t->hash_next;
+
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->cached = 0;
+	thumb_cache_used -= t->size;
+
+	if (!t->refs)
+		free(t);
+}
+
+static struct thumb_entry *thumb_cache_get(uint32_t handle)
+{
+	struct thumb_entry *t;
+
+	pthread_mutex_lock(&thumb_lock);
+	for (t = thumb_hash[handle % THUMB_CACHE_HASH]; t; t = t->hash_next)
+		if (t->handle == handle)
+			break;
+	if (t) {
+		t->refs++;
+		/* Move to the head of the LRU list */
+		t->prev->next = t->next;
+		t->next->prev = t->prev;
+		t->next = thumb_lru.next;
+		t->prev = &thumb_lru;
+		thumb_lru.next->prev = t;
+		thumb_lru.next = t;
+	}
+	pthread_mutex_unlock(&thumb_lock);
+
+	return t;
+}
+
+static void thumb_cache_put(struct thumb_entry *t)
+{
+	pthread_mutex_lock(&thumb_lock);
+	if (!--t->refs && !t->cached)
+		free(t);
+	pthread_mutex_unlock(&thumb_lock);
+}
+
+/* Insert a referenced entry, evicting the least recently used ones */
+static void thumb_cache_insert(struct thumb_entry *t)
+{
+	struct thumb_entry **p;
+
+	if (t->size > THUMB_CACHE_SIZE)
+		return;
+
+	pthread_mutex_lock(&thumb_lock);
+
+	/* Somebody else has been faster */
+	for (p = &thumb_hash[t->handle % THUMB_CACHE_HASH]; *p; p = &(*p)->hash_next)
+		if ((*p)->handle == t->handle)
+			goto unlock;
+
+	while (thumb_cache_used + t->size > THUMB_CACHE_SIZE)
+		thumb_cache_unlink(thumb_lru.prev);
+
+	t->hash_next = NULL;
+	*p = t;
+	t->next = thumb_lru.next;
+	t->prev = &thumb_lru;
+	thumb_lru.next->prev = t;
+	thumb_lru.next = t;
+	t->cached = 1;
+	thumb_cache_used += t->size;
+
+unlock:
+	pthread_mutex_unlock(&thumb_lock);
+}
+
+/* The object has been deleted or modified */
+static void thumb_cache_invalidate(uint32_t handle)
+{
+	struct thumb_entry *t;
+
+	pthread_mutex_lock(&thumb_lock);
+	for (t = thumb_hash[handle % THUMB_CACHE_HASH]; t; t = t->hash_next)
+		if (t->handle == handle) {
+			thumb_cache_unlink(t);
+			break;
+		}
+	pthread_mutex_unlock(&thumb_lock);
+}
+
+/* Read a thumbnail into a new, referenced entry */
+static struct thumb_entry *thumb_read(uint32_t handle, uint64_t hash, size_t size)
+{
+	struct ptp_container *c;
+	struct thumb_entry *t;
+
+	t = malloc(sizeof(*t) + sizeof(*c) + size);
+	if (!t)
+		return NULL;
+
+	t->handle	= handle;
+	t->refs		= 1;
+	t->cached	= 0;
+	t->size		= sizeof(*c) + size;
+
+	c = (struct ptp_container *)t->data;
+	c->length	= __cpu_to_le32(t->size);
+	c->type		= __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
+	c->code		= __cpu_to_le16(PIMA15740_OP_GET_THUMB);
+
+	if (pack_read(hash, c->payload, size) < 0) {
+		free(t);
+		return NULL;
+	}
+
+	return t;
+}
+
+/* Read a thumbnail into a new, referenced entry and cache it */
+static struct thumb_entry *thumb_load(struct obj_list *obj)
+{
+	struct thumb_entry *t;
+
+	t = thumb_read(obj->handle, obj->thumb_hash,
+		       __le32_to_cpu(obj->info.thumb_compressed_size));
+	if (t)
+		thumb_cache_insert(t);
+
+	return t;
+}
+
+/*
+ * Prefetcher: hosts walk the objects in handle order, GetObjectInfo and then
+ * GetThumb for a grid view, GetObject for a selection. Once two consecutive
+ * requests of a kind have asked for neighbouring objects, the thumbnails, or
+ * the beginning of the files, of the next prefetch.depth objects are read
+ * ahead by the prefetch thread. The depth doubles when GetThumb misses the
+ * cache too often during a walk, and halves when a walk breaks.
+ */
+#define PREFETCH_QUEUE		128
+#define PREFETCH_DEPTH_MIN	4
+#define PREFETCH_DEPTH_MAX	64
+/* GetThumb requests per hit rate measurement */
+#define PREFETCH_WINDOW		16
+/* Bytes of a file to read ahead */
+#define PREFETCH_READAHEAD	(4 * 1024 * 1024)
+
+enum prefetch_kind {
+	PREFETCH_THUMB,
+	PREFETCH_FILE,
+	PREFETCH_KINDS,
+};
+
+struct prefetch_item {
+	enum prefetch_kind	kind;
+	uint32_t		handle;		/* 0 if cancelled */
+	uint64_t		thumb_hash;
+	size_t			thumb_size;
+	char			name[256];
+};
+
+struct prefetch_walk {
+	uint32_t		last;		/* handle of the last request */
+	struct obj_list		*obj;		/* its object, NULL once deleted */
+	uint32_t		ahead;		/* queued up to this handle */
+	int			streak;
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct prefetch_item	queue[PREFETCH_QUEUE];
+	unsigned int		head, tail;
+	uint32_t		busy;		/* handle being prefetched, 0 if cancelled */
+	/* bulk thread only */
+	struct prefetch_walk	walk[PREFETCH_KINDS];
+	int			depth, hits, lookups;
+} prefetch = {
+	.lock	= PTHREAD_MUTEX_INITIALIZER,
+	.cond	= PTHREAD_COND_INITIALIZER,
+	.depth	= PREFETCH_DEPTH_MIN,
+};
+
+static void prefetch_thumb(const struct prefetch_item *item)
+{
+	struct thumb_entry *t;
+
+	t = thumb_cache_get(item->handle);
+	if (!t)
+		t = thumb_read(item->handle, item->thumb_hash, item->thumb_size);
+	if (!t)
+		return;
+
+	/* Unless the object has been deleted in the meantime */
+	pthread_mutex_lock(&prefetch.lock);
+	if (prefetch.busy == item->handle)
+		thumb_cache_insert(t);
+	pthread_mutex_unlock(&prefetch.lock);
+
+	thumb_cache_put(t);
+}
+
+static void prefetch_file(const struct prefetch_item *item)
+{
+	int fd;
+
+	fd = openat(root_fd, item->name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	posix_fadvise(fd, 0, PREFETCH_READAHEAD, POSIX_FADV_WILLNEED);
+	close(fd);
+}
+
+static void *prefetch_thread(void *param)
+{
+	struct prefetch_item item;
+
+	for (;;) {
+		pthread_mutex_lock(&prefetch.lock);
+		while (prefetch.head == prefetch.tail)
+			pthread_cond_wait(&prefetch.cond, &prefetch.lock);
+		item = prefetch.queue[prefetch.head++ % PREFETCH_QUEUE];
+		prefetch.busy = item.handle;
+		pthread_mutex_unlock(&prefetch.lock);
+
+		if (!item.handle)
+			continue;
+
+		if (item.kind == PREFETCH_THUMB)
+			prefetch_thumb(&item);
+		else
+			prefetch_file(&item);
+	}
+
+	return NULL;
+}
+
+static int init_prefetch_thread(void)
+{
+	pthread_t thread;
+	int ret;
+
+	ret = pthread_create(&thread, NULL, prefetch_thread, NULL);
+	if (ret) {
+		errno = ret;
+		perror("can't create prefetch thread");
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+/* bulk thread: the object is being deleted */
+static void prefetch_cancel(uint32_t handle)
+{
+	unsigned int i;
+
+	for (i = 0; i < PREFETCH_KINDS; i++)
+		if (prefetch.walk[i].obj && prefetch.walk[i].obj->handle == handle)
+			prefetch.walk[i].obj = NULL;
+
+	pthread_mutex_lock(&prefetch.lock);
+	for (i = prefetch.head; i != prefetch.tail; i++)
+		if (prefetch.queue[i % PREFETCH_QUEUE].handle == handle)
+			prefetch.queue[i % PREFETCH_QUEUE].handle = 0;
+	if (prefetch.busy == handle)
+		prefetch.busy = 0;
+	pthread_mutex_unlock(&prefetch.lock);
+}
+
+/* bulk thread: GetThumb has found the thumbnail in the cache or not */
+static void prefetch_account(int hit)
+{
+	if (!prefetch.walk[PREFETCH_THUMB].streak)
+		return;
+
+	prefetch.hits += hit;
+	if (++prefetch.lookups < PREFETCH_WINDOW)
+		return;
+
+	/* Less than 3/4 hits: the prefetch thread doesn't keep ahead of the host */
+	if (prefetch.hits * 4 < prefetch.lookups * 3 && prefetch.depth < PREFETCH_DEPTH_MAX) {
+		prefetch.depth *= 2;
+		if (verbose)
+			fprintf(stderr, "Prefetch: %d of %d thumbnails cached, depth %d\n",
+				prefetch.hits, prefetch.lookups, prefetch.depth);
+	}
+	prefetch.hits = prefetch.lookups = 0;
+}
+
+/* bulk thread: a transaction on @handle has been completed */
+static void prefetch_note(unsigned long code, uint32_t handle)
+{
+	struct obj_list *obj, *prev = NULL;
+	struct prefetch_item *item;
+	struct prefetch_walk *w;
+	enum prefetch_kind kind;
+	int i;
+
+	switch (code) {
+	case PIMA15740_OP_GET_OBJECT_INFO:
+	case PIMA15740_OP_GET_THUMB:
+		kind = PREFETCH_THUMB;
+		break;
+	case PIMA15740_OP_GET_OBJECT:
+	case PIMA15740_OP_GET_PARTIAL_OBJECT:
+		kind = PREFETCH_FILE;
+		break;
+	default:
+		return;
+	}
+
+	w = &prefetch.walk[kind];
+	/* GetThumb after GetObjectInfo, or partial reads, of the same object */
+	if (handle == w->last)
+		return;
+
+	/* A walk goes on from the last object, otherwise search the list sorted by handle */
+	if (w->obj && w->obj->next && w->obj->next->handle == handle) {
+		prev = w->obj;
+		obj = prev->next;
+	} else {
+		for (obj = images; obj && obj->handle != handle; obj = obj->next)
+			prev = obj;
+		if (!obj)
+			return;
+	}
+
+	if (prev && prev->handle == w->last) {
+		w->streak++;
+	} else {
+		if (w->streak)
+			prefetch.depth = max(prefetch.depth / 2, PREFETCH_DEPTH_MIN);
+		w->streak = 0;
+		w->ahead = handle;
+	}
+	w->last = handle;
+	w->obj = obj;
+
+	if (!w->streak)
+		return;
+
+	pthread_mutex_lock(&prefetch.lock);
+	for (i = 0, obj = obj->next; obj && i < prefetch.depth; i++, obj = obj->next) {
+		if (obj->handle <= w->ahead)
+			continue;
+		if (prefetch.tail - prefetch.head == PREFETCH_QUEUE)
+			break;
+		w->ahead = obj->handle;
+		if (kind == PREFETCH_THUMB ? !obj->thumb_hash : obj->mem_fd >= 0)
+			continue;
+
+		item = &prefetch.queue[prefetch.tail++ % PREFETCH_QUEUE];
+		item->kind		= kind;
+		item->handle		= obj->handle;
+		item->thumb_hash	= obj->thumb_hash;
+		item->thumb_size	= __le32_to_cpu(obj->info.thumb_compressed_size);
+		strcpy(item->name, obj->name);
+	}
+	pthread_cond_signal(&prefetch.cond);
+	pthread_mutex_unlock(&prefetch.lock);
+}
+
+static int send_thumb(struct ptp_container *r_container, struct ptp_container *s_container,
+		      struct obj_list *obj)
+{
+	struct thumb_entry *t;
+	int ret;
+
+	if (!obj->thumb_hash) {
+		make_response(s_container, r_container, PIMA15740_RESP_NO_THUMBNAIL_PRESENT,
+			      sizeof(*s_container));
+		return 0;
+	}
+
+	t = thumb_cache_get(obj->handle);
+	prefetch_account(!!t);
+	if (!t)
+		t = thumb_load(obj);
+	if (!t) {
+		make_response(s_container, r_container, PIMA15740_RESP_INCOMPLETE_TRANSFER,
+			      sizeof(*s_container));
+		return 0;
+	}
+
+	/* Only the transaction ID changes from one request to the next */
+	((struct ptp_container *)t->data)->id = r_container->id;
+	ret = engine_write(t->data, t->size);
+	thumb_cache_put(t);
+	if (ret < 0) {
+		errno = EPIPE;
+		return ret;
+	}
+
+	make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+
+	return 0;
+}
+
+/* Send file_size bytes of the object from offset, partial requests get their size back */
+static int send_object(struct ptp_container *r_container, void *send_buf, size_t send_len,
+		       struct obj_list *obj, uint64_t offset, uint64_t file_size, int partial)
+{
+	struct ptp_container *s_container = send_buf;
+	struct open_object *o;
+	uint64_t total;
+	int ret = 1;
+
+	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
+
+	total = file_size + sizeof(*s_container);
+	if (verbose)
+		fprintf(stderr, "%s(): total %llu\n", __func__, (unsigned long long)total);
+	/* Containers beyond 4GiB have length 0xffffffff and end with a short packet */
+	s_container->length = __cpu_to_le32(min(total, (uint64_t)PTP_PARAM_ANY));
+
+	if (obj->mem_fd >= 0)
+		obj->used = ++ram_store_clock;
+
+	o = open_object_get(obj);
+	if (o) {
+		if (file_size <= PREAD_MAX)
+			ret = send_file_pread(o->fd, s_container, offset, file_size);
+		else if (data_ring.fd >= 0)
+			ret = send_file_uring(o->fd, s_container, offset, file_size);
+		else
+			ret = send_file_mmap(o, send_buf, send_len, offset, file_size);
+	}
+
+	if (!ret && total >= PTP_PARAM_ANY && !(total % bulk_maxpacket()))
+		ret = engine_write(send_buf, 0);
+
+	if (ret > 0) {
+		/* Failed before anything has been sent */
+		make_response(s_container, r_container, PIMA15740_RESP_INCOMPLETE_TRANSFER,
+			      sizeof(*s_container));
+		return 0;
+	}
+
+	if (ret < 0) {
+		errno = EPIPE;
+		return ret;
+	}
+
+	/* Prepare response */
+	if (partial) {
+		*(uint32_t *)s_container->payload = __cpu_to_le32(file_size);
+		make_response(s_container, r_container, PIMA15740_RESP_OK,
+			      sizeof(*s_container) + sizeof(uint32_t));
+	} else {
+		make_response(s_container, r_container, PIMA15740_RESP_OK,
+			      sizeof(*s_container));
+	}
+
+	return 0;
+}
+
+static struct obj_list *lookup_object(uint32_t handle)
+{
+	struct obj_list *obj;
+
+	for (obj = images; obj; obj = obj->next)
+		if (obj->handle == handle)
+			break;
+
+	return obj;
+}
+
+static int send_object_or_thumb(void *recv_buf, void *send_buf, size_t send_len, int thumb)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	uint32_t *param;
+	struct obj_list *obj;
+
+	param = (uint32_t *)r_container->payload;
+	obj = lookup_object(__le32_to_cpu(*param));
+	if (!obj) {
+		make_response(s_container, r_container, PIMA15740_RESP_INVALID_OBJECT_HANDLE,
+			      sizeof(*s_container));
+		return 0;
+	}
+
+	if (thumb)
+		return send_thumb(r_container, s_container, obj);
+
+	return send_object(r_container, send_buf, send_len, obj, 0, obj->size, 0);
+}
+
+static int send_partial_object(void *recv_buf, void *send_buf, size_t send_len)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	uint32_t *param, offset, max;
+	struct obj_list *obj;
+
+	param = (uint32_t *)r_container->payload;
+	obj = lookup_object(__le32_to_cpu(*param));
+	offset = __le32_to_cpu(*(param + 1));
+	max = __le32_to_cpu(*(param + 2));
+
+	if (!obj) {
+		make_response(s_container, r_container, PIMA15740_RESP_INVALID_OBJECT_HANDLE,
+			      sizeof(*s_container));
+		return 0;
+	}
+
+	if (offset > obj->size) {
+		make_response(s_container, r_container, PIMA15740_RESP_INVALID_PARAMETER,
+			      sizeof(*s_container));
+		return 0;
+	}
+
+	/* MaxBytes 0xffffffff reads up to the end of the object */
+	return send_object(r_container, send_buf, send_len, obj, offset,
+			   min(obj->size - offset, (uint64_t)max), 1);
+}
+
+/*
+ * MTP object properties. Values are taken from the object index: the file
+ * name and date strings are copied out of the stored ObjectInfo, the two
+ * associations /DCIM and /DCIM/PTP_MODEL_DIR are described by prop_obj too.
+ */
+static const struct mtp_prop {
+	uint16_t	code;
+	uint16_t	type;
+} mtp_props[] = {
+	{ MTP_PROP_STORAGE_ID,		PTP_TYPE_UINT32, },
+	{ MTP_PROP_OBJECT_FORMAT,	PTP_TYPE_UINT16, },
+	{ MTP_PROP_PROTECTION_STATUS,	PTP_TYPE_UINT16, },
+	{ MTP_PROP_OBJECT_SIZE,		PTP_TYPE_UINT64, },
+	{ MTP_PROP_OBJECT_FILE_NAME,	PTP_TYPE_STR, },
+	{ MTP_PROP_DATE_CREATED,	PTP_TYPE_STR, },
+	{ MTP_PROP_DATE_MODIFIED,	PTP_TYPE_STR, },
+	{ MTP_PROP_PARENT_OBJECT,	PTP_TYPE_UINT32, },
+	{ MTP_PROP_NAME,		PTP_TYPE_STR, },
+};
+
+/* Property code, data type and the longest possible value, a 255 character string */
+#define MTP_PROP_ELEMENT_MAX	(4 + 2 + 2 + 1 + 2 * 255)
+
+struct prop_obj {
+	uint32_t			handle;
+	uint32_t			parent;
+	uint64_t			size;
+	const struct ptp_object_info	*info;
+	const uint8_t			*name;		/* PTP strings */
+	const uint8_t			*date;
+};
+
+static uint8_t dcim_name[1 + 2 * sizeof("DCIM")];
+static uint8_t model_dir_name[1 + 2 * sizeof(PTP_MODEL_DIR)];
+static const uint8_t empty_string[1];
+
+static uint16_t mtp_prop_type(uint32_t code)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(mtp_props); i++)
+		if (mtp_props[i].code == code)
+			return mtp_props[i].type;
+
+	return 0;
+}
+
+static void prop_obj_image(struct prop_obj *p, struct obj_list *obj)
+{
+	p->handle	= obj->handle;
+	p->parent	= __le32_to_cpu(obj->info.parent_object);
+	p->size		= obj->size;
+	p->info		= &obj->info;
+	p->name		= obj->info.strings;
+	/* The capture date follows the file name */
+	p->date		= p->name + 1 + 2 * p->name[0];
+}
+
+static void prop_obj_association(struct prop_obj *p, uint32_t handle)
+{
+	p->handle	= handle;
+	p->parent	= handle - 1;
+	p->size		= __le32_to_cpu(association.object_compressed_size);
+	p->info		= &association;
+	p->name		= handle == 1 ? dcim_name : model_dir_name;
+	p->date		= empty_string;
+}
+
+/* Find an object by handle, including the associations */
+static int prop_obj_get(struct prop_obj *p, uint32_t handle)
+{
+	struct obj_list *obj;
+
+	if (handle == 1 || handle == 2) {
+		prop_obj_association(p, handle);
+		return 0;
+	}
+
+	obj = lookup_object(handle);
+	if (!obj)
+		return -1;
+
+	prop_obj_image(p, obj);
+	return 0;
+}
+
+/* Encode a property value into buf, or only return its size if buf is NULL */
+static int prop_encode(const struct prop_obj *p, uint16_t code, uint8_t *buf)
+{
+	const uint8_t *str;
+	uint64_t v;
+	int i, len;
+
+	switch (code) {
+	case MTP_PROP_STORAGE_ID:
+		v = __le32_to_cpu(p->info->storage_id);
+		len = 4;
+		break;
+	case MTP_PROP_OBJECT_FORMAT:
+		v = __le16_to_cpu(p->info->object_format);
+		len = 2;
+		break;
+	case MTP_PROP_PROTECTION_STATUS:
+		v = __le16_to_cpu(p->info->protection_status);
+		len = 2;
+		break;
+	case MTP_PROP_OBJECT_SIZE:
+		v = p->size;
+		len = 8;
+		break;
+	case MTP_PROP_PARENT_OBJECT:
+		v = p->parent;
+		len = 4;
+		break;
+	case MTP_PROP_OBJECT_FILE_NAME:
+	case MTP_PROP_NAME:
+		str = p->name;
+		goto string;
+	case MTP_PROP_DATE_CREATED:
+	case MTP_PROP_DATE_MODIFIED:
+		/* We only have the file modification date */
+		str = p->date;
+		goto string;
+	default:
+		return -1;
+	}
+
+	if (buf)
+		for (i = 0; i < len; i++)
+			buf[i] = v >> (8 * i);
+	return len;
+
+string:
+	len = 1 + 2 * str[0];
+	if (buf)
+		memcpy(buf, str, len);
+	return len;
+}
+
+static int send_object_prop_value(void *recv_buf, void *send_buf, size_t send_len)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	struct prop_obj p;
+	uint32_t *param;
+	int ret, len;
+
+	param = (uint32_t *)r_container->payload;
+
+	if (prop_obj_get(&p, __le32_to_cpu(*param)) < 0) {
+		make_response(s_container, r_container, PIMA15740_RESP_INVALID_OBJECT_HANDLE,
+			      sizeof(*s_container));
+		return 0;
+	}
+
+	len = prop_encode(&p, __le32_to_cpu(*(param + 1)), s_container->payload);
+	if (len < 0) {
+		make_response(s_container, r_container, MTP_RESP_INVALID_OBJECT_PROP_CODE,
+			      sizeof(*s_container));
+		return 0;
+	}
+
+	len += sizeof(*s_container);
+	s_container->type	= __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
+	s_container->length	= __cpu_to_le32(len);
+	ret = engine_write(s_container, len);
+	if (ret < 0) {
+		errno = EPIPE;
+		return ret;
+	}
+
+	make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+
+	return 0;
+}
+
+static int send_object_props_supported(void *recv_buf, void *send_buf, size_t send_len)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	uint8_t *data = s_container->payload;
+	size_t count;
+	int i, ret;
+
+	/* The same properties for all formats */
+	*(uint32_t *)data = __cpu_to_le32(ARRAY_SIZE(mtp_props));
+	data += sizeof(uint32_t);
+	for (i = 0; i < ARRAY_SIZE(mtp_props); i++, data += sizeof(uint16_t))
+		*(uint16_t *)data = __cpu_to_le16(mtp_props[i].code);
+
+	count = data - (uint8_t *)send_buf;
+	s_container->type	= __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
+	s_container->length	= __cpu_to_le32(count);
+	ret = engine_write(s_container, count);
+	if (ret < 0) {
+		errno = EPIPE;
+		return ret;
+	}
+
+	make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+
+	return 0;
+}
+
+static int send_object_prop_desc(void *recv_buf, void *send_buf, size_t send_len)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	uint8_t *data = s_container->payload;
+	uint32_t *param, code;
+	uint16_t type;
+	size_t count;
+	int ret;
+
+	param = (uint32_t *)r_container->payload;
+	code = __le32_to_cpu(*param);
+
+	type = mtp_prop_type(code);
+	if (!type) {
+		make_response(s_container, r_container, MTP_RESP_INVALID_OBJECT_PROP_CODE,
+			      sizeof(*s_container));
+		return 0;
+	}
+
+	*(uint16_t *)data = __cpu_to_le16(code);
+	*(uint16_t *)(data + 2) = __cpu_to_le16(type);
+	data[4] = 0;			/* Get only */
+	data += 5;
+
+	/* Default value: 0 or an empty string */
+	switch (type) {
+	case PTP_TYPE_UINT16:
+		count = 2;
+		break;
+	case PTP_TYPE_UINT32:
+		count = 4;
+		break;
+	case PTP_TYPE_UINT64:
+		count = 8;
+		break;
+	default:
+		count = 1;
+	}
+	memset(data, 0, count);
+	data += count;
+
+	*(uint32_t *)data = __cpu_to_le32(0);	/* Group code */
+	data[4] = 0;				/* No form */
+	data += 5;
+
+	count = data - (uint8_t *)send_buf;
+	s_container->type	= __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
+	s_container->length	= __cpu_to_le32(count);
+	ret = engine_write(s_container, count);
+	if (ret < 0) {
+		errno = EPIPE;
+		return ret;
+	}
+
+	make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+
+	return 0;
+}
+
+/*
+ * A data phase assembled in the send buffer, which is written out whenever it
+ * is full: only the last write may end in a short packet.
+ */
+struct data_stream {
+	uint8_t		*buf;
+	size_t		size;
+	size_t		pos;
+};
+
+static int stream_put(struct data_stream *ds, const void *data, size_t len)
+{
+	size_t count;
+	int ret;
+
+	while (len) {
+		count = min(len, ds->size - ds->pos);
+		memcpy(ds->buf + ds->pos, data, count);
+		ds->pos += count;
+		data += count;
+		len -= count;
+
+		if (ds->pos == ds->size) {
+			ret = engine_write(ds->buf, ds->size);
+			if (ret < 0)
+				return ret;
+			ds->pos = 0;
+		}
+	}
+
+	return 0;
+}
+
+static int stream_flush(struct data_stream *ds)
+{
+	int ret = 0;
+
+	if (ds->pos)
+		ret = engine_write(ds->buf, ds->pos);
+	ds->pos = 0;
+
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * GetObjectPropList walks the index twice: once to size the data phase, and
+ * once to send it.
+ */
+struct prop_list {
+	uint32_t		handle;
+	uint32_t		format;
+	uint32_t		prop;
+	uint32_t		depth;
+	struct data_stream	*ds;		/* NULL when sizing */
+	uint32_t		elements;
+	uint64_t		length;
+};
+
+/* Our hierarchy is fixed: / - /DCIM - /DCIM/PTP_MODEL_DIR - images */
+static uint32_t object_parent(uint32_t handle)
+{
+	return handle <= 2 ? handle - 1 : 2;
+}
+
+static int prop_list_selected(const struct prop_list *pl, uint32_t handle)
+{
+	uint32_t h;
+
+	if (pl->handle == PTP_PARAM_ANY)
+		return 1;
+
+	switch (pl->depth) {
+	case 0:
+		return handle == pl->handle;
+	case 1:
+		return object_parent(handle) == pl->handle;
+	}
+
+	/* All levels below pl->handle */
+	for (h = handle; h; h = object_parent(h))
+		if (object_parent(h) == pl->handle)
+			return 1;
+
+	return 0;
+}
+
+static int prop_list_add(struct prop_list *pl, const struct prop_obj *p)
+{
+	uint8_t element[MTP_PROP_ELEMENT_MAX];
+	int i, len;
+
+	if (pl->format && pl->format != PTP_PARAM_ANY &&
+	    pl->format != __le16_to_cpu(p->info->object_format))
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(mtp_props); i++) {
+		if (pl->prop != PTP_PARAM_ANY && pl->prop != mtp_props[i].code)
+			continue;
+
+		len = prop_encode(p, mtp_props[i].code, pl->ds ? element + 8 : NULL);
+		pl->elements++;
+		pl->length += 8 + len;
+		if (!pl->ds)
+			continue;
+
+		*(uint32_t *)element = __cpu_to_le32(p->handle);
+		*(uint16_t *)(element + 4) = __cpu_to_le16(mtp_props[i].code);
+		*(uint16_t *)(element + 6) = __cpu_to_le16(mtp_props[i].type);
+		if (stream_put(pl->ds, element, 8 + len) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int prop_list_walk(struct prop_list *pl)
+{
+	struct obj_list *obj;
+	struct prop_obj p;
+	uint32_t h;
+
+	for (h = 1; h <= 2; h++)
+		if (prop_list_selected(pl, h)) {
+			prop_obj_association(&p, h);
+			if (prop_list_add(pl, &p) < 0)
+				return -1;
+		}
+
+	for (obj = images; obj; obj = obj->next)
+		if (prop_list_selected(pl, obj->handle)) {
+			prop_obj_image(&p, obj);
+			if (prop_list_add(pl, &p) < 0)
+				return -1;
+		}
+
+	return 0;
+}
+
+static int send_object_prop_list(void *recv_buf, void *send_buf, size_t send_len)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	struct data_stream ds = {
+		.buf	= send_buf,
+		.size	= send_len,
+		.pos	= sizeof(*s_container) + sizeof(uint32_t),
+	};
+	struct prop_list pl = { .ds = NULL, };
+	enum pima15740_response_code code = PIMA15740_RESP_OK;
+	uint32_t *param;
+	uint64_t total;
+	int ret;
+
+	param = (uint32_t *)r_container->payload;
+	pl.handle	= __le32_to_cpu(*param);
+	pl.format	= __le32_to_cpu(*(param + 1));
+	pl.prop		= __le32_to_cpu(*(param + 2));
+	pl.depth	= __le32_to_cpu(*(param + 4));
+
+	if (!pl.prop)
+		/* Property groups are not supported */
+		code = MTP_RESP_SPECIFICATION_BY_GROUP_UNSUPPORTED;
+	else if (pl.prop != PTP_PARAM_ANY && !mtp_prop_type(pl.prop))
+		code = MTP_RESP_OBJECT_PROP_NOT_SUPPORTED;
+	else if (pl.handle != PTP_PARAM_ANY && pl.depth > 1 && pl.depth != PTP_PARAM_ANY)
+		code = MTP_RESP_SPECIFICATION_BY_DEPTH_UNSUPPORTED;
+	else if (pl.handle != PTP_PARAM_ANY && !(pl.handle == 0 && pl.depth) &&
+		 !object_handle_valid(pl.handle))
+		code = PIMA15740_RESP_INVALID_OBJECT_HANDLE;
+	if (code != PIMA15740_RESP_OK) {
+		make_response(s_container, r_container, code, sizeof(*s_container));
+		return 0;
+	}
+
+	prop_list_walk(&pl);
+
+	total = sizeof(*s_container) + sizeof(uint32_t) + pl.length;
+	s_container->type	= __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
+	s_container->length	= __cpu_to_le32(min(total, (uint64_t)PTP_PARAM_ANY));
+	*(uint32_t *)s_container->payload = __cpu_to_le32(pl.elements);
+	if (verbose)
+		fprintf(stderr, "%u object properties, %llu bytes\n", pl.elements,
+			(unsigned long long)total);
+
+	pl.ds = &ds;
+	ret = prop_list_walk(&pl);
+	if (!ret)
+		ret = stream_flush(&ds);
+	if (ret < 0) {
+		errno = EPIPE;
+		return ret;
+	}
+
+	/* Prepare response */
+	make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+
+	return 0;
+}
+
+static int send_storage_ids(void *recv_buf, void *send_buf, size_t send_len)
+{
+	struct ptp_container *s_container = send_buf;
+	uint32_t *param, n = 1;
+	int ret;
+
+	param = (uint32_t *)s_container->payload;
+	*(param + 1) = __cpu_to_le32(STORE_ID);
+	if (capture_source)
+		*(param + 1 + n++) = __cpu_to_le32(RAM_STORE_ID);
+	*param = __cpu_to_le32(n);
+
+	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
+	s_container->length = __cpu_to_le32(sizeof(*s_container) + (n + 1) * sizeof(*param));
+	ret = engine_write(send_buf, __le32_to_cpu(s_container->length));
+	if (ret < 0) {
+		errno = EPIPE;
+		return ret;
+	}
+
+	/* Prepare response */
+	memcpy(send_buf, recv_buf, sizeof(*s_container));
+	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_RESPONSE_BLOCK);
+	s_container->code = __cpu_to_le16(PIMA15740_RESP_OK);
+	s_container->length = __cpu_to_le32(sizeof(*s_container));
+
+	return 0;
+}
+
+/*
+ * Storage accounting: capacity and free space are cached in storage_info,
+ * adjusted as objects come and go and re-read with statfs() by a background
+ * thread, at most once per STORAGE_REFRESH_SEC. Free space in images is
+ * estimated from the mean size of the objects in the index.
+ */
+#define STORAGE_REFRESH_SEC	5
+
+static pthread_mutex_t storage_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t storage_cond = PTHREAD_COND_INITIALIZER;
+static int storage_valid, storage_refresh_pending;
+static time_t storage_refreshed;
+static unsigned long storage_block_size = 1;
+static unsigned long long storage_free, storage_obj_bytes;
+static unsigned int storage_obj_count;
+
+static time_t monotonic_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/* Called with storage_lock held */
+static void storage_update_info(void)
+{
+	unsigned long long mean, images = PTP_PARAM_ANY;
+
+	if (storage_obj_count) {
+		mean = storage_obj_bytes / storage_obj_count;
+		if (mean)
+			images = min(storage_free / mean, (unsigned long long)PTP_PARAM_ANY - 1);
+	}
+
+	/* Tell the host when the store runs out of room for one more image */
+	if (!images && storage_info.free_space_in_images)
+		event_post(PIMA15740_EVENT_STORE_FULL, STORE_ID);
+
+	storage_info.free_space_in_bytes	= __cpu_to_le64(storage_free);
+	storage_info.free_space_in_images	= __cpu_to_le32(images);
+}
+
+static void storage_account(long long size, int n)
+{
+	unsigned long long blocks;
+
+	pthread_mutex_lock(&storage_lock);
+
+	/* Files occupy whole blocks */
+	blocks = ((size < 0 ? -size : size) + storage_block_size - 1) / storage_block_size;
+	if (size < 0) {
+		storage_free += blocks * storage_block_size;
+		storage_obj_bytes -= min(storage_obj_bytes, (unsigned long long)-size);
+	} else {
+		storage_free -= min(storage_free, blocks * storage_block_size);
+		storage_obj_bytes += size;
+	}
+	storage_obj_count += n;
+	storage_update_info();
+
+	pthread_mutex_unlock(&storage_lock);
+}
+
+#define storage_account_add(size)	storage_account(size, 1)
+#define storage_account_remove(size)	storage_account(-(long long)(size), -1)
+
+static int storage_refresh(void)
+{
+	struct statfs fs;
+	int ret;
+
+	ret = fstatfs(root_fd, &fs);
+	if (ret < 0) {
+		fprintf(stderr, "statfs %s: %s\n", root, strerror(errno));
+		return ret;
+	}
+
+	if (verbose > 1)
+		fprintf(stderr, "Block-size %ld, total 0x%lx, free 0x%lx\n",
+			(long)fs.f_bsize, fs.f_blocks, fs.f_bfree);
+
+	pthread_mutex_lock(&storage_lock);
+	if (storage_valid && storage_free != (unsigned long long)fs.f_bsize * fs.f_bfree)
+		event_post(PIMA15740_EVENT_STORAGE_INFO_CHANGED, STORE_ID);
+	storage_block_size = fs.f_bsize;
+	storage_free = (unsigned long long)fs.f_bsize * fs.f_bfree;
+	storage_info.max_capacity = __cpu_to_le64((unsigned long long)fs.f_bsize * fs.f_blocks);
+	storage_update_info();
+	storage_valid = 1;
+	storage_refreshed = monotonic_sec();
+	pthread_mutex_unlock(&storage_lock);
+
+	return 0;
+}
+
+/* Ask the refresh thread for a new statfs(), it will honour the rate limit */
+static void storage_request_refresh(void)
+{
+	pthread_mutex_lock(&storage_lock);
+	storage_refresh_pending = 1;
+	pthread_cond_signal(&storage_cond);
+	pthread_mutex_unlock(&storage_lock);
+}
+
+static void *storage_thread(void *param)
+{
+	time_t wait;
+
+	for (;;) {
+		pthread_mutex_lock(&storage_lock);
+		while (!storage_refresh_pending)
+			pthread_cond_wait(&storage_cond, &storage_lock);
+		storage_refresh_pending = 0;
+		wait = storage_refreshed + STORAGE_REFRESH_SEC - monotonic_sec();
+		pthread_mutex_unlock(&storage_lock);
+
+		if (wait > 0 && wait <= STORAGE_REFRESH_SEC)
+			sleep(wait);
+
+		storage_refresh();
+	}
+
+	return NULL;
+}
+
+static int init_storage(void)
+{
+	pthread_t thread;
+	int ret;
+
+	storage_refresh();
+
+	ret = pthread_create(&thread, NULL, storage_thread, NULL);
+	if (ret) {
+		errno = ret;
+		perror("can't create storage thread");
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+/* The RAM store is accounted exactly, free space in images from the mean size */
+static int send_ram_storage_info(void *recv_buf, void *send_buf)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	uint64_t free = ram_store_budget - ram_store_bytes, images = PTP_PARAM_ANY - 1;
+	size_t count;
+	int ret;
+
+	if (ram_store_count)
+		images = min(free / (ram_store_bytes / ram_store_count + 1), images);
+	if (ram_store_max)
+		images = min((uint64_t)(ram_store_max - ram_store_count), images);
+
+	ram_storage_info.max_capacity		= __cpu_to_le64(ram_store_budget);
+	ram_storage_info.free_space_in_bytes	= __cpu_to_le64(free);
+	ram_storage_info.free_space_in_images	= __cpu_to_le32(images);
+
+	count = sizeof(ram_storage_info) + sizeof(*s_container);
+
+	s_container->type	= __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
+	s_container->length	= __cpu_to_le32(count);
+	memcpy(send_buf + sizeof(*s_container), &ram_storage_info, sizeof(ram_storage_info));
+
+	ret = engine_write(s_container, count);
+	if (ret < 0) {
+		errno = EPIPE;
+		return ret;
+	}
+
+	/* Prepare response */
+	make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+
+	return 0;
+}
+
+static int send_storage_info(void *recv_buf, void *send_buf, size_t send_len)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	uint32_t *param;
+	uint32_t store_id;
+	int ret, valid;
+	size_t count;
+
+	param = (uint32_t *)r_container->payload;
+	store_id = __le32_to_cpu(*param);
+
+	if (capture_source && store_id == RAM_STORE_ID)
+		return send_ram_storage_info(recv_buf, send_buf);
+
+	if (verbose)
+		fprintf(stderr, "%u bytes storage info\n", sizeof(storage_info));
+
+	if (store_id != STORE_ID) {
+		make_response(s_container, r_container,
+			      PIMA15740_RESP_INVALID_STORAGE_ID, sizeof(*s_container));
+		return 0;
+	}
+
+	count = sizeof(storage_info) + sizeof(*s_container);
+
+	s_container->type	= __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
+	s_container->length	= __cpu_to_le32(count);
+
+	pthread_mutex_lock(&storage_lock);
+	valid = storage_valid;
+	memcpy(send_buf + sizeof(*s_container), &storage_info, sizeof(storage_info));
+	if (monotonic_sec() - storage_refreshed >= STORAGE_REFRESH_SEC) {
+		storage_refresh_pending = 1;
+		pthread_cond_signal(&storage_cond);
+	}
+	pthread_mutex_unlock(&storage_lock);
+
+	if (!valid) {
+		make_response(s_container, r_container,
+			      PIMA15740_RESP_ACCESS_DENIED, sizeof(*s_container));
+		return 0;
+	}
+
+	ret = engine_write(s_container, count);
+	if (ret < 0) {
+		errno = EPIPE;
+		return ret;
+	}
+
+	/* Prepare response */
+	make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+
+	return 0;
+}
+
+static void delete_thumb(struct obj_list *obj)
+{
+	/* Copies of the image may still use the thumbnail */
+	if (obj->thumb_hash)
+		pack_put(obj->thumb_hash);
+}
+
+/*
+ * The permission rule of the kernel, without capabilities and ACLs, applied
+ * both when an image is listed and when it is deleted
+ */
+static int stat_protected(const struct stat *st)
+{
+	if (geteuid() == st->st_uid)
+		return !(st->st_mode & S_IWUSR);
+
+	if (getegid() == st->st_gid)
+		return !(st->st_mode & S_IWGRP);
+
+	return !(st->st_mode & S_IWOTH);
+}
+
+static enum pima15740_response_code delete_file(const char *name)
+{
+	struct stat st;
+	int ret;
+
+	/* access() is unreliable on NFS, we use stat() instead */
+	ret = fstatat(root_fd, name, &st, 0);
+	if (ret < 0) {
+		fprintf(stderr, "Cannot stat %s: %s\n", name, strerror(errno));
+		return PIMA15740_RESP_GENERAL_ERROR;
+	}
+
+	if (stat_protected(&st))
+		return PIMA15740_RESP_OBJECT_WRITE_PROTECTED;
+
+	ret = unlinkat(root_fd, name, 0);
+	if (ret) {
+		fprintf(stderr, "Cannot delete %s: %s\n",
+			name, strerror(errno));
+		return PIMA15740_RESP_GENERAL_ERROR;
+	}
+
+	return PIMA15740_RESP_OK;
+}
+
+/*
+ * Asynchronous deletion: objects are unlinked from the index synchronously,
+ * so that the host gets its response immediately, and queued for a pool of
+ * worker threads, which remove files and thumbnails in batches. Free space is
+ * re-read once, when the queue drains.
+ */
+#define DELETE_THREADS		4
+#define DELETE_BATCH		64
+
+static struct obj_list *delete_queue, **delete_tail = &delete_queue;
+/* Objects, whose files are still there, for the bulk thread to put back */
+static struct obj_list *delete_failed;
+static pthread_mutex_t delete_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t delete_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t delete_idle = PTHREAD_COND_INITIALIZER;
+static int delete_busy;
+
+static void *delete_thread(void *param)
+{
+	enum pima15740_response_code code;
+	struct obj_list *batch, *obj;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&delete_lock);
+		while (!delete_queue)
+			pthread_cond_wait(&delete_cond, &delete_lock);
+
+		/* Detach up to DELETE_BATCH objects from the head of the queue */
+		batch = delete_queue;
+		for (i = 1, obj = batch; i < DELETE_BATCH && obj->next; i++)
+			obj = obj->next;
+		delete_queue = obj->next;
+		if (!delete_queue)
+			delete_tail = &delete_queue;
+		obj->next = NULL;
+		delete_busy++;
+		pthread_mutex_unlock(&delete_lock);
+
+		while (batch) {
+			obj = batch;
+			batch = obj->next;
+
+			if (obj->mem_fd >= 0) {
+				close(obj->mem_fd);
+			} else {
+				code = delete_file(obj->name);
+				if (code != PIMA15740_RESP_OK) {
+					/* Changed since it was listed */
+					if (code == PIMA15740_RESP_OBJECT_WRITE_PROTECTED)
+						obj->info.protection_status = __cpu_to_le16(1);
+					pthread_mutex_lock(&delete_lock);
+					obj->next = delete_failed;
+					delete_failed = obj;
+					pthread_mutex_unlock(&delete_lock);
+					continue;
+				}
+				handle_forget(obj->handle);
+				delete_thumb(obj);
+			}
+			free(obj);
+		}
+
+		pthread_mutex_lock(&delete_lock);
+		i = !--delete_busy && !delete_queue;
+		pthread_mutex_unlock(&delete_lock);
+
+		/* The last worker to go idle has free space re-read and handles saved once */
+		if (i) {
+			storage_request_refresh();
+			handles_save();
+
+			pthread_mutex_lock(&delete_lock);
+			pthread_cond_broadcast(&delete_idle);
+			pthread_mutex_unlock(&delete_lock);
+		}
+	}
+
+	return NULL;
+}
+
+static int init_delete_threads(void)
+{
+	pthread_t thread;
+	int i, ret;
+
+	for (i = 0; i < DELETE_THREADS; i++) {
+		ret = pthread_create(&thread, NULL, delete_thread, NULL);
+		if (ret) {
+			errno = ret;
+			perror("can't create delete thread");
+			return -1;
+		}
+		pthread_detach(thread);
+	}
+
+	return 0;
+}
+
+/* Wait for all queued deletions to be carried out */
+static void delete_drain(void)
+{
+	pthread_mutex_lock(&delete_lock);
+	while (delete_queue || delete_busy)
+		pthread_cond_wait(&delete_idle, &delete_lock);
+	pthread_mutex_unlock(&delete_lock);
+}
+
+/*
+ * Objects, which could not be deleted, are put back in handle order, the host
+ * learns about them with ObjectAdded. The handle is only forgotten once the
+ * file is gone, so they keep it.
+ */
+static void delete_restore(void)
+{
+	struct obj_list *failed, *obj, **anchor;
+
+	pthread_mutex_lock(&delete_lock);
+	failed = delete_failed;
+	delete_failed = NULL;
+	pthread_mutex_unlock(&delete_lock);
+
+	while ((obj = failed)) {
+		failed = obj->next;
+
+		for (anchor = &images; *anchor && (*anchor)->handle < obj->handle;
+		     anchor = &(*anchor)->next)
+			;
+		obj->next = *anchor;
+		*anchor = obj;
+		storage_account_add(obj->size);
+		object_number++;
+
+		if (verbose)
+			fprintf(stderr, "%s could not be deleted, restored\n", obj->name);
+
+		event_post(PIMA15740_EVENT_OBJECT_ADDED, obj->handle);
+	}
+}
+
+/* Called with the object already unlinked from the images list */
+static void queue_delete(struct obj_list *obj)
+{
+	prefetch_cancel(obj->handle);
+	thumb_cache_invalidate(obj->handle);
+	open_cache_invalidate(obj->handle);
+
+	obj->next = NULL;
+	if (obj->mem_fd >= 0) {
+		ram_store_bytes -= obj->size;
+		ram_store_count--;
+		event_post(PIMA15740_EVENT_STORAGE_INFO_CHANGED, RAM_STORE_ID);
+	} else {
+		storage_account_remove(obj->size);
+	}
+	object_number--;
+
+	/* From here on obj belongs to the delete threads */
+	pthread_mutex_lock(&delete_lock);
+	*delete_tail = obj;
+	delete_tail = &obj->next;
+	pthread_cond_signal(&delete_cond);
+	pthread_mutex_unlock(&delete_lock);
+}
+
+/* Write protection is taken from the object info, collected at enumeration */
+static int object_protected(struct obj_list *obj)
+{
+	return __le16_to_cpu(obj->info.protection_status) != 0;
+}
+
+static enum pima15740_response_code delete_handle(uint32_t handle)
+{
+	struct obj_list *obj, **anchor;
+
+	if (handle == 1 || handle == 2)
+		/* read-only /DCIM and /DCIM/100LINUX */
+		return PIMA15740_RESP_OBJECT_WRITE_PROTECTED;
+
+	for (anchor = &images; (obj = *anchor); anchor = &obj->next)
+		if (obj->handle == handle)
+			break;
+
+	if (!obj)
+		return PIMA15740_RESP_INVALID_OBJECT_HANDLE;
+
+	if (object_protected(obj))
+		return PIMA15740_RESP_OBJECT_WRITE_PROTECTED;
+
+	*anchor = obj->next;
+	queue_delete(obj);
+
+	return PIMA15740_RESP_OK;
+}
+
+static void delete_object(void *recv_buf, void *send_buf)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	enum pima15740_response_code code = PIMA15740_RESP_OK;
+	uint32_t format, handle;
+	uint32_t *param;
+	unsigned long length;
+
+	length = __le32_to_cpu(r_container->length);
+
+	param = (uint32_t *)r_container->payload;
+	handle = __le32_to_cpu(*param);
+	format = __le32_to_cpu(*(param + 1));
+
+	if (length > 16 && format != PTP_PARAM_UNUSED) {
+		/* ObjectFormatCode not supported */
+		code = PIMA15740_RESP_SPECIFICATION_BY_FORMAT_NOT_SUPPORTED;
+	} else if (handle == PTP_PARAM_ANY) {
+		struct obj_list *obj, **anchor;
+		int partial = 0;
+
+		anchor = &images;
+
+		while ((obj = *anchor)) {
+			if (object_protected(obj)) {
+				anchor = &obj->next;
+				partial++;
+			} else {
+				*anchor = obj->next;
+				queue_delete(obj);
+			}
+		}
+
+		if (partial)
+			code = PIMA15740_RESP_PARTIAL_DELETION;
+	} else {
+		code = delete_handle(handle);
+	}
+
+	make_response(s_container, r_container, code, sizeof(*s_container));
+}
+
+/*
+ * InitiateCapture: the capture source, a shell command given with -C, is run
+ * for every capture and writes one JPEG frame to its standard output. The pipe
+ * is spliced into a memfd, which is sealed and becomes the data of a new
+ * object in the RAM store. Captured objects never touch the disk, GetObject
+ * sends them from the memfd through the same paths as files, they are gone on
+ * restart.
+ */
+#define CAPTURE_TIMEOUT_MS	5000
+#define CAPTURE_MAX		(64 * 1024 * 1024)
+/* Captures are named CAP_0000.JPG to CAP_9999.JPG */
+#define CAPTURE_NAMES		10000
+
+static unsigned int capture_count;
+
+struct capture_job {
+	pid_t	producer;
+	int	pipe;
+	int	fd;
+};
+
+/* Also a cleanup handler, if the bulk thread is cancelled during a capture */
+static void capture_abort(void *param)
+{
+	struct capture_job *job = param;
+	int status;
+
+	close(job->pipe);
+	close(job->fd);
+	kill(job->producer, SIGKILL);
+	waitpid(job->producer, &status, 0);
+}
+
+/* Run the capture source, returns a sealed memfd with the frame or -1 */
+static int capture_frame(uint64_t *size)
+{
+	struct capture_job job;
+	struct pollfd pfd;
+	struct timespec now;
+	int pipefd[2], status;
+	uint64_t total = 0, deadline;
+	int64_t left;
+	ssize_t ret;
+
+	/* The whole frame within CAPTURE_TIMEOUT_MS, not each piece of it */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	deadline = ts_ns(&now) + CAPTURE_TIMEOUT_MS * 1000000ULL;
+
+	job.fd = memfd_create("ptp-capture", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (job.fd < 0)
+		return -1;
+
+	if (pipe2(pipefd, O_CLOEXEC) < 0) {
+		close(job.fd);
+		return -1;
+	}
+
+	job.producer = fork();
+	if (job.producer < 0) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+		close(job.fd);
+		return -1;
+	}
+
+	if (!job.producer) {
+		if (dup2(pipefd[1], STDOUT_FILENO) >= 0)
+			execl("/bin/sh", "sh", "-c", capture_source, NULL);
+		_exit(EXIT_FAILURE);
+	}
+
+	close(pipefd[1]);
+	job.pipe = pipefd[0];
+
+	pthread_cleanup_push(capture_abort, &job);
+
+	pfd.fd		= job.pipe;
+	pfd.events	= POLLIN;
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = (int64_t)(deadline - ts_ns(&now));
+		ret = left > 0 ? poll(&pfd, 1, (left + 999999) / 1000000) : 0;
+		if (!ret) {
+			errno = ETIMEDOUT;
+			ret = -1;
+		}
+		if (ret > 0)
+			ret = splice(job.pipe, NULL, job.fd, NULL, CAPTURE_MAX - total, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		total += ret;
+		if (total == CAPTURE_MAX) {
+			errno = EFBIG;
+			ret = -1;
+			break;
+		}
+	}
+
+	pthread_cleanup_pop(0);
+
+	if (ret < 0) {
+		fprintf(stderr, "Capture failed: %s\n", strerror(errno));
+		capture_abort(&job);
+		return -1;
+	}
+
+	close(job.pipe);
+	waitpid(job.producer, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) || !total) {
+		fprintf(stderr, "Capture source failed, %llu bytes\n", (unsigned long long)total);
+		close(job.fd);
+		return -1;
+	}
+
+	/* The object does not change any more, like a file on a read-only store */
+	fcntl(job.fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+
+	*size = total;
+	return job.fd;
+}
+
+static struct obj_list *ram_store_find(const char *name)
+{
+	struct obj_list *obj;
+
+	for (obj = images; obj; obj = obj->next)
+		if (obj->mem_fd >= 0 && !strcmp(obj->name, name))
+			return obj;
+
+	return NULL;
+}
+
+/* Make room for an object of size bytes, no larger than the budget */
+static void ram_store_evict(uint64_t size)
+{
+	struct obj_list *obj, **anchor, **lru;
+	uint32_t handle;
+
+	while (ram_store_bytes + size > ram_store_budget ||
+	       (ram_store_max && ram_store_count >= ram_store_max)) {
+		lru = NULL;
+		for (anchor = &images; (obj = *anchor); anchor = &obj->next)
+			if (obj->mem_fd >= 0 && (!lru || obj->used < (*lru)->used))
+				lru = anchor;
+		if (!lru)
+			break;
+
+		obj = *lru;
+		*lru = obj->next;
+		handle = obj->handle;
+
+		if (verbose)
+			fprintf(stderr, "Evicting %s, %llu bytes\n",
+				obj->name, (unsigned long long)obj->size);
+
+		queue_delete(obj);
+		event_post(PIMA15740_EVENT_OBJECT_REMOVED, handle);
+	}
+}
+
+static void initiate_capture(void *recv_buf, void *send_buf)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	enum pima15740_response_code code;
+	struct obj_list *obj, **anchor;
+	uint32_t storage = 0, format = 0;
+	uint32_t *param;
+	unsigned long length;
+	struct stat st;
+	char name[16];
+	uint64_t size;
+	int fd, i;
+
+	length = __le32_to_cpu(r_container->length);
+
+	param = (uint32_t *)r_container->payload;
+	if (length > 12)
+		storage = __le32_to_cpu(*param);
+	if (length > 16)
+		format = __le32_to_cpu(*(param + 1));
+
+	if (!capture_source) {
+		code = PIMA15740_RESP_OPERATION_NOT_SUPPORTED;
+		goto resp;
+	}
+
+	if (storage && storage != RAM_STORE_ID) {
+		code = PIMA15740_RESP_INVALID_STORAGE_ID;
+		goto resp;
+	}
+
+	if (format && format != PIMA15740_FMT_I_EXIF_JPEG) {
+		code = PIMA15740_RESP_INVALID_OBJECT_FORMAT_CODE;
+		goto resp;
+	}
+
+	/* Names of files in the directory and of earlier captures are left alone */
+	for (i = 0; i < CAPTURE_NAMES; i++) {
+		snprintf(name, sizeof(name), "CAP_%04u.JPG", ++capture_count % CAPTURE_NAMES);
+		if (fstatat(root_fd, name, &st, 0) < 0 && !ram_store_find(name))
+			break;
+	}
+	if (i == CAPTURE_NAMES) {
+		code = PIMA15740_RESP_STORE_FULL;
+		goto resp;
+	}
+
+	fd = capture_frame(&size);
+	if (fd < 0) {
+		code = PIMA15740_RESP_GENERAL_ERROR;
+		goto resp;
+	}
+
+	if (size > ram_store_budget) {
+		close(fd);
+		code = PIMA15740_RESP_STORE_FULL;
+		goto resp;
+	}
+
+	obj = object_new(name, time(NULL), size, 0, PIMA15740_FMT_I_EXIF_JPEG, 0);
+	if (!obj) {
+		close(fd);
+		code = PIMA15740_RESP_GENERAL_ERROR;
+		goto resp;
+	}
+
+	/* Only once the capture is certain to be kept */
+	ram_store_evict(size);
+
+	/* In the root of the RAM store */
+	obj->info.storage_id	= __cpu_to_le32(RAM_STORE_ID);
+	obj->info.parent_object	= __cpu_to_le32(0);
+	obj->mem_fd		= fd;
+	obj->used		= ++ram_store_clock;
+	obj->handle		= handle_new();
+	ram_store_bytes += size;
+	ram_store_count++;
+	event_post(PIMA15740_EVENT_STORAGE_INFO_CHANGED, RAM_STORE_ID);
+
+	/* Handles only grow, the list stays sorted */
+	for (anchor = &images; *anchor; anchor = &(*anchor)->next)
+		;
+	*anchor = obj;
+	object_number++;
+
+	if (verbose)
+		fprintf(stderr, "Captured %s, %llu bytes, handle %u\n",
+			name, (unsigned long long)size, obj->handle);
+
+	/* The event thread waits for a burst to end, the response goes out first */
+	event_post_id(PIMA15740_EVENT_OBJECT_ADDED, obj->handle, __le32_to_cpu(r_container->id));
+	event_post_id(PIMA15740_EVENT_CAPTURE_COMPLETE, 0, __le32_to_cpu(r_container->id));
+	code = PIMA15740_RESP_OK;
+
+resp:
+	make_response(s_container, r_container, code, sizeof(*s_container));
+}
+
+/* Read the data phase of a host-to-device transaction */
+static int bulk_read(void *buf, size_t length)
+{
+	int ret;
+
+	ret = engine_read(buf, length);
+
+	if (verbose && ret >= 0)
+		fprintf(stderr, "BULK-OUT Received %d bytes\n", ret);
+
+	return ret;
+}
+
+/*
+ * Vendor DeleteObjectList: the data phase carries a PTP array of object
+ * handles, all of which are deleted within one transaction. The array is
+ * consumed as it arrives, so its size is not limited by the buffer size.
+ */
+static int delete_object_list(void *recv_buf, void *send_buf, size_t recv_len)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	struct ptp_container cmd = *r_container;
+	enum pima15740_response_code code = PIMA15740_RESP_OK;
+	size_t total = 0, have = 0, done = 0, skip, used;
+	uint32_t n = 0, *handle;
+	int ret, partial = 0, protected = 0, deleted = 0;
+
+	for (;;) {
+		ret = bulk_read(recv_buf + have, recv_len - have);
+		if (ret < 0) {
+			errno = EPIPE;
+			return ret;
+		}
+		if (!ret)
+			break;
+		have += ret;
+
+		skip = 0;
+		if (!total) {
+			if (have < sizeof(*r_container) + sizeof(n))
+				continue;
+			total = __le32_to_cpu(r_container->length);
+			if (__le16_to_cpu(r_container->type) != PTP_CONTAINER_TYPE_DATA_BLOCK ||
+			    total < sizeof(*r_container) + sizeof(n)) {
+				fprintf(stderr, "Bad DeleteObjectList data phase\n");
+				errno = EPIPE;
+				return -1;
+			}
+			n = __le32_to_cpu(*(uint32_t *)r_container->payload);
+			skip = sizeof(*r_container) + sizeof(n);
+		}
+
+		/* Consume complete handles, keep a partial one for the next read */
+		for (handle = recv_buf + skip;
+		     (void *)(handle + 1) <= recv_buf + have && done < n;
+		     handle++, done++) {
+			switch (delete_handle(__le32_to_cpu(*handle))) {
+			case PIMA15740_RESP_OK:
+				deleted++;
+				break;
+			case PIMA15740_RESP_OBJECT_WRITE_PROTECTED:
+				protected++;
+				/* fall through */
+			default:
+				partial++;
+			}
+		}
+
+		/* Anything past the last announced handle is discarded */
+		used = done < n ? (void *)handle - recv_buf : have;
+		used = min(used, total);
+		total -= used;
+		have -= used;
+		memmove(recv_buf, recv_buf + used, have);
+
+		if (!total)
+			break;
+	}
+
+	if (done < n || total) {
+		code = PIMA15740_RESP_INCOMPLETE_TRANSFER;
+	} else if (partial) {
+		if (deleted)
+			code = PIMA15740_RESP_PARTIAL_DELETION;
+		else if (protected == partial)
+			code = PIMA15740_RESP_OBJECT_WRITE_PROTECTED;
+		else
+			code = PIMA15740_RESP_INVALID_OBJECT_HANDLE;
+	}
+
+	make_response(s_container, &cmd, code, sizeof(*s_container));
+
+	return 0;
+}
+
+static int process_command(void *recv_buf, size_t count, size_t *recv_size,
+			   void *send_buf, size_t *send_size)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	struct object_filter filter;
+	uint32_t *param, p1, p2, p3;
+	unsigned long length, type, code;
+	int ret;
+
+	type	= __le16_to_cpu(r_container->type);
+	code	= __le16_to_cpu(r_container->code);
+
+	/* The index only changes here, between transactions */
+	delete_restore();
+
+	ret = -1;
+
+	switch (type) {
+	case PTP_CONTAINER_TYPE_COMMAND_BLOCK:
+		switch (code) {
+		case PIMA15740_OP_GET_DEVICE_INFO:
+			CHECK_COUNT(count, 12, 12, "GET_DEVICE_INFO");
+
+			if (verbose)
+				fprintf(stderr, "%u bytes device info\n", sizeof(dev_info));
+			count = sizeof(dev_info) + sizeof(*s_container);
+
+			/* First part: data block */
+			s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
+			s_container->length = __cpu_to_le32(count);
+			memcpy(send_buf + sizeof(*s_container), &dev_info, sizeof(dev_info));
+			ret = engine_write(s_container, count);
+			if (ret < 0)
+				return ret;
+
+			/* Second part: response block */
+			s_container = send_buf + count;
+			make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+
+			break;
+		case PIMA15740_OP_OPEN_SESSION:
+			CHECK_COUNT(count, 16, 16, "OPEN_SESSION");
+
+			ret = sizeof(*s_container);
+			param = (uint32_t *)r_container->payload;
+			p1 = __le32_to_cpu(*param);
+			if (verbose)
+				fprintf(stderr, "OpenSession %d\n", p1);
+			/* No multiple sessions. */
+			if (session > 0) {
+				/* already open */
+				code = PIMA15740_RESP_SESSION_ALREADY_OPEN;
+				*param = __cpu_to_le32(session);
+				ret += sizeof(*param);
+			} else if (!p1) {
+				code = PIMA15740_RESP_INVALID_PARAMETER;
+			} else {
+				code = PIMA15740_RESP_OK;
+				session = p1;
+			}
+			make_response(s_container, r_container, code, ret);
+			count = 0;
+			break;
+		case PIMA15740_OP_CLOSE_SESSION:
+			CHECK_COUNT(count, 12, 12, "CLOSE_SESSION");
+
+			if (session > 0) {
+				code = PIMA15740_RESP_OK;
+				session = -EINVAL;
+			} else {
+				code = PIMA15740_RESP_SESSION_NOT_OPEN;
+			}
+			make_response(s_container, r_container, code, sizeof(*s_container));
+			ret = 0;
+			count = 0;
+			break;
+		case PIMA15740_OP_GET_OBJECT_HANDLES:
+			CHECK_COUNT(count, 16, 24, "GET_OBJECT_HANDLES");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = send_object_handles(recv_buf, send_buf, *send_size);
+			count = ret; /* even if ret is negative, handled below */
+			break;
+		case PIMA15740_OP_GET_OBJECT_INFO:
+			CHECK_COUNT(count, 16, 16, "GET_OBJECT_INFO");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = send_object_info(recv_buf, send_buf, *send_size);
+			count = ret; /* even if ret is negative, handled below */
+			break;
+		case PIMA15740_OP_GET_STORAGE_IDS:
+			CHECK_COUNT(count, 12, 12, "GET_STORAGE_IDS");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = send_storage_ids(recv_buf, send_buf, *send_size);
+			count = ret; /* even if ret is negative, handled below */
+			break;
+		case PIMA15740_OP_GET_STORAGE_INFO:
+			CHECK_COUNT(count, 16, 16, "GET_STORAGE_INFO");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = send_storage_info(recv_buf, send_buf, *send_size);
+			count = ret; /* even if ret is negative, handled below */
+			break;
+		case PIMA15740_OP_GET_OBJECT:
+			CHECK_COUNT(count, 16, 16, "GET_OBJECT");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = send_object_or_thumb(recv_buf, send_buf, *send_size, 0);
+			count = ret; /* even if ret is negative, handled below */
+			break;
+		case PIMA15740_OP_GET_PARTIAL_OBJECT:
+			CHECK_COUNT(count, 24, 24, "GET_PARTIAL_OBJECT");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = send_partial_object(recv_buf, send_buf, *send_size);
+			count = ret; /* even if ret is negative, handled below */
+			break;
+		case MTP_OP_GET_OBJECT_PROPS_SUPPORTED:
+			CHECK_COUNT(count, 16, 16, "GET_OBJECT_PROPS_SUPPORTED");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = send_object_props_supported(recv_buf, send_buf, *send_size);
+			count = ret; /* even if ret is negative, handled below */
+			break;
+		case MTP_OP_GET_OBJECT_PROP_DESC:
+			CHECK_COUNT(count, 20, 20, "GET_OBJECT_PROP_DESC");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = send_object_prop_desc(recv_buf, send_buf, *send_size);
+			count = ret; /* even if ret is negative, handled below */
+			break;
+		case MTP_OP_GET_OBJECT_PROP_VALUE:
+			CHECK_COUNT(count, 20, 20, "GET_OBJECT_PROP_VALUE");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = send_object_prop_value(recv_buf, send_buf, *send_size);
+			count = ret; /* even if ret is negative, handled below */
+			break;
+		case MTP_OP_GET_OBJECT_PROP_LIST:
+			CHECK_COUNT(count, 32, 32, "GET_OBJECT_PROP_LIST");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = send_object_prop_list(recv_buf, send_buf, *send_size);
+			count = ret; /* even if ret is negative, handled below */
+			break;
+		case PIMA15740_OP_GET_NUM_OBJECTS:
+			CHECK_COUNT(count, 16, 24, "GET_NUM_OBJECTS");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = 12;
+			param = (uint32_t *)r_container->payload;
+			p1 = __le32_to_cpu(*param);
+			p2 = __le32_to_cpu(*(param + 1));
+			p3 = __le32_to_cpu(*(param + 2));
+			if (count > 16 && p2 != PTP_PARAM_UNUSED && p2 != PTP_PARAM_ANY)
+				code = PIMA15740_RESP_SPECIFICATION_BY_FORMAT_NOT_SUPPORTED;
+			else
+				code = object_filter_init(&filter, p1,
+							  count > 20 ? p3 : PTP_PARAM_UNUSED);
+			if (code == PIMA15740_RESP_OK) {
+				for (p2 = 0; object_filter_next(&filter); p2++)
+					;
+				ret += sizeof(*param);
+				*param = __cpu_to_le32(p2);
+			}
+			make_response(s_container, r_container, code, ret);
+			count = 0;
+			break;
+		case PIMA15740_OP_GET_THUMB:
+			CHECK_COUNT(count, 16, 16, "GET_THUMB");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = send_object_or_thumb(recv_buf, send_buf, *send_size, 1);
+			count = ret; /* even if ret is negative, handled below */
+			break;
+		case PIMA15740_OP_DELETE_OBJECT:
+			CHECK_COUNT(count, 16, 20, "DELETE_OBJECT");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			delete_object(recv_buf, send_buf);
+			count = 0;
+			ret = 0;
+			break;
+		case PTP_VENDOR_OP_DELETE_OBJECT_LIST:
+			CHECK_COUNT(count, 12, 12, "DELETE_OBJECT_LIST");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = delete_object_list(recv_buf, send_buf, *recv_size);
+			count = ret; /* even if ret is negative, handled below */
+			break;
+		case PIMA15740_OP_INITIATE_CAPTURE:
+			CHECK_COUNT(count, 12, 20, "INITIATE_CAPTURE");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			initiate_capture(recv_buf, send_buf);
+			count = 0;
+			ret = 0;
+			break;
+		}
+		break;
+	}
+
+	if (ret < 0) {
+		if (errno == EPIPE)
+			return -1;
+
+		if (verbose)
+			fprintf(stderr, "Unsupported type %lu code %lu\n", type, code);
+		errno = EOPNOTSUPP;
+		make_response(s_container, r_container,
+			      PIMA15740_RESP_OPERATION_NOT_SUPPORTED, sizeof(*s_container));
+		count = 0;
+	}
+
+	/* send out response at send_buf + count */
+	s_container = send_buf + count;
+	length = __le32_to_cpu(s_container->length);
+	return engine_write(s_container, length);
+}
+
+/*
+ * bulk thread context: the transaction cannot be completed, the device stalls
+ * as in Figure 7.2-1 of the Still Image class specification. Queued data is
+ * dropped and bulk-in halted, Device Status reports @code and the halted
+ * endpoint. The host clears the halt, which gadgetfs handles without telling
+ * us, and carries on with a new command: that is when the halt is taken to be
+ * over. Anything else received until then is discarded.
+ */
+static void io_stall(uint16_t code)
+{
+	int err;
+
+	if (verbose)
+		fprintf(stderr, "Stalling transaction %u, status 0x%x\n", transaction_id, code);
+
+	__atomic_store_n(&device_status, code, __ATOMIC_RELAXED);
+	__atomic_store_n(&io_halted, 1, __ATOMIC_RELEASE);
+
+	/* Replaying, there is no endpoint */
+	if (bulk_in >= 0) {
+		if (ioctl(bulk_in, GADGETFS_FIFO_FLUSH) < 0 && errno != EOPNOTSUPP)
+			perror("flush source fd");
+		/* Endpoints are halted by an I/O request in the wrong direction */
+		if (read(bulk_in, &err, 0) != -1 || errno != EBADMSG)
+			perror("halt source fd");
+	}
+
+	sink->flush();
+	io_set_state(IO_IDLE);
+}
+
+static int process_one_request(void *recv_buf, size_t *recv_size, void *send_buf, size_t *send_size)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	unsigned long length = *recv_size, type, code, id;
+	size_t count = 0;
+	int ret;
+
+	/* A new transaction starts */
+	io_aborted = 0;
+	io_timed_out = 0;
+
+	do {
+		ret = engine_read(recv_buf + count, *recv_size - count);
+		if (ret < 0) {
+			return ret;
+		} else {
+			count += ret;
+			if (count >= sizeof(*s_container)) {
+				length	= __le32_to_cpu(r_container->length);
+				type	= __le16_to_cpu(r_container->type);
+				code	= __le16_to_cpu(r_container->code);
+				id	= __le32_to_cpu(r_container->id);
+			}
+		}
+
+		/* Stalled, only a command ends the halt */
+		if (count >= sizeof(*s_container) && io_halted &&
+		    type != PTP_CONTAINER_TYPE_COMMAND_BLOCK) {
+			if (verbose)
+				fprintf(stderr, "Dropping container type %lu while halted\n", type);
+			sink->flush();
+			return 0;
+		}
+
+		if (count >= sizeof(*s_container) &&
+		    (length < sizeof(*s_container) || length > *recv_size))
+			break;
+	} while (count < length);
+
+	if (count != length) {
+		fprintf(stderr, "BULK-OUT ERROR: received %u byte, expected %lu\n",
+			count, length);
+		errno = EPIPE;
+		return -1;
+	}
+
+	if (type == PTP_CONTAINER_TYPE_COMMAND_BLOCK)
+		__atomic_store_n(&io_halted, 0, __ATOMIC_RELEASE);
+
+	memcpy(send_buf, recv_buf, sizeof(*s_container));
+
+	if (verbose)
+		fprintf(stderr, "BULK-OUT Received %lu byte, type %lu, code 0x%lx, id %lu\n",
+			length, type, code, id);
+
+	if (type == PTP_CONTAINER_TYPE_COMMAND_BLOCK) {
+		pthread_mutex_lock(&io_lock);
+		transaction_id = id;
+		io_state = IO_BUSY;
+		pthread_mutex_unlock(&io_lock);
+		transaction_code = code;
+		__atomic_store_n(&device_status, PIMA15740_RESP_OK, __ATOMIC_RELAXED);
+	}
+
+	ret = process_command(recv_buf, count, recv_size, send_buf, send_size);
+
+	if (record_file)
+		fflush(record_file);
+
+	if (ret >= 0 && type == PTP_CONTAINER_TYPE_COMMAND_BLOCK &&
+	    length >= sizeof(*r_container) + sizeof(uint32_t))
+		prefetch_note(code, __le32_to_cpu(*(uint32_t *)r_container->payload));
+
+	if (ret < 0 && io_aborted) {
+		errno = ECONNRESET;
+		return -1;
+	}
+
+	if (ret < 0 && cancel_requested()) {
+		transaction_cancelled();
+		return 0;
+	}
+
+	io_set_state(IO_IDLE);
+
+	return ret;
+}
+
+static void *bulk_thread(void *param)
+{
+	void *recv_buf, *send_buf;
+	int ret;
+	size_t s_size = XFER_BUF_SIZE, r_size = XFER_BUF_SIZE;
+
+	/* The thread is cancelled by stop_io(), then the buffers go back to the pool */
+	recv_buf = xfer_get();
+	pthread_cleanup_push(xfer_put, recv_buf);
+	send_buf = xfer_get();
+	pthread_cleanup_push(xfer_put, send_buf);
+
+	io_timer_init();
+	pthread_cleanup_push(io_timer_exit, NULL);
+
+	if (!recv_buf || !send_buf) {
+		fprintf(stderr, "No transfer buffers!\n");
+		goto done;
+	}
+
+	do {
+		ret = process_one_request(recv_buf, &r_size, send_buf, &s_size);
+		if (ret < 0 && errno == ECONNRESET) {
+			/* Reset by the host, wait for the next command */
+			ret = 0;
+			continue;
+		}
+		if (ret < 0 && errno == EPIPE) {
+			/* Protocol error or a host, that has stopped reading */
+			io_stall(io_timed_out ? PIMA15740_RESP_INCOMPLETE_TRANSFER :
+				 PIMA15740_RESP_GENERAL_ERROR);
+			ret = 0;
+			continue;
+		}
+
+		pthread_testcancel();
+	} while (ret >= 0);
+
+done:
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+	pthread_exit(NULL);
+}
+
+#define REPLAY_OPS	64
+
+struct op_stats {
+	uint16_t	code;
+	unsigned long	count;
+	uint64_t	cpu_ns;
+	uint64_t	allocs;
+	uint64_t	alloc_bytes;
+	uint64_t	sent;
+};
+
+static int op_stats_cmp(const void *a, const void *b)
+{
+	return (int)((const struct op_stats *)a)->code - ((const struct op_stats *)b)->code;
+}
+
+static void replay_report(struct op_stats *ops, int n_ops, uint64_t wall_ns)
+{
+	struct op_stats total = { .code = 0, };
+	int i;
+
+	qsort(ops, n_ops, sizeof(*ops), op_stats_cmp);
+
+	printf("%-8s %8s %12s %10s %10s %12s %14s\n", "opcode", "count", "cpu us",
+	       "us/op", "allocs", "alloc bytes", "bytes sent");
+	for (i = 0; i < n_ops; i++) {
+		printf("0x%04x   %8lu %12llu %10.1f %10llu %12llu %14llu\n", ops[i].code,
+		       ops[i].count, (unsigned long long)ops[i].cpu_ns / 1000,
+		       ops[i].cpu_ns / 1000.0 / ops[i].count,
+		       (unsigned long long)ops[i].allocs,
+		       (unsigned long long)ops[i].alloc_bytes,
+		       (unsigned long long)ops[i].sent);
+		total.count += ops[i].count;
+		total.cpu_ns += ops[i].cpu_ns;
+		total.allocs += ops[i].allocs;
+		total.alloc_bytes += ops[i].alloc_bytes;
+		total.sent += ops[i].sent;
+	}
+	printf("%-8s %8lu %12llu %10s %10llu %12llu %14llu\n", "total", total.count,
+	       (unsigned long long)total.cpu_ns / 1000, "",
+	       (unsigned long long)total.allocs, (unsigned long long)total.alloc_bytes,
+	       (unsigned long long)total.sent);
+	printf("recorded %.3f s, replayed in %.3f s\n",
+	       (replay_last_ns - replay_first_ns) / 1e9, wall_ns / 1e9);
+#ifndef REPLAY_ALLOCS
+	printf("allocations are only counted when built with REPLAY_ALLOCS=1\n");
+#endif
+}
+
+/*
+ * Run a recorded host session against the engine, without gadgetfs, and
+ * report CPU time and allocations per operation code. The session has to be
+ * replayed against the same tree it was recorded with, for the handles to
+ * match, and operations which modify the tree do so again.
+ */
+static int replay(const char *path)
+{
+	struct op_stats ops[REPLAY_OPS], *op;
+	size_t r_size = XFER_BUF_SIZE, s_size = XFER_BUF_SIZE;
+	struct timespec start, end, t0, t1;
+	uint64_t allocs, bytes, sent;
+	void *recv_buf, *send_buf;
+	int n_ops = 0, i, ret;
+
+	replay_file = fopen(path, "r");
+	if (!replay_file) {
+		perror(path);
+		return -1;
+	}
+
+	recv_buf = xfer_get();
+	send_buf = xfer_get();
+	if (!recv_buf || !send_buf) {
+		fprintf(stderr, "No transfer buffers!\n");
+		ret = -1;
+		goto out;
+	}
+
+	sink = &replay_sink;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (;;) {
+		allocs = alloc_count;
+		bytes = alloc_bytes;
+		sent = replay_sent;
+		transaction_code = 0;
+
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+		ret = process_one_request(recv_buf, &r_size, send_buf, &s_size);
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+
+		if (replay_eof) {
+			ret = 0;
+			break;
+		}
+		if (ret < 0 && errno == EPIPE) {
+			/* As on the bus, the host is expected to recover */
+			io_stall(PIMA15740_RESP_GENERAL_ERROR);
+			continue;
+		}
+		if (ret < 0) {
+			perror("replay");
+			break;
+		}
+
+		for (i = 0, op = ops; i < n_ops && op->code != transaction_code; i++, op++)
+			;
+		if (i == n_ops) {
+			if (n_ops == REPLAY_OPS)
+				continue;
+			memset(op, 0, sizeof(*op));
+			op->code = transaction_code;
+			n_ops++;
+		}
+
+		op->count++;
+		op->cpu_ns += ts_ns(&t1) - ts_ns(&t0);
+		op->allocs += alloc_count - allocs;
+		op->alloc_bytes += alloc_bytes - bytes;
+		op->sent += replay_sent - sent;
+	}
+
+	/* Deletions are part of the session */
+	delete_drain();
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	replay_report(ops, n_ops, ts_ns(&end) - ts_ns(&start));
+
+out:
+	xfer_put(recv_buf);
+	xfer_put(send_buf);
+	free(replay_buf);
+	fclose(replay_file);
+
+	return ret;
+}
+
+static int start_io(void)
+{
+	int ret;
+	char buf[256];
+
+	if (verbose)
+		fprintf(stderr, "Start bulk EPs\n");
+
+	if (bulk_in >= 0 && bulk_out >= 0)
+		return 0;
+
+	snprintf(buf, sizeof(buf), "/dev/gadget/%s", EP_IN_NAME);
+	bulk_in = source_open(buf);
+	if (bulk_in < 0)
+		return bulk_in;
+
+	snprintf(buf, sizeof(buf), "/dev/gadget/%s", EP_OUT_NAME);
+	bulk_out = sink_open(buf);
+	if (bulk_out < 0)
+		return bulk_out;
+
+	snprintf(buf, sizeof(buf), "/dev/gadget/%s", EP_STATUS_NAME);
+	interrupt = int_open(buf);
+	if (interrupt < 0)
+		return interrupt;
+
+	status = PTP_IDLE;
+	__atomic_store_n(&io_request, 0, __ATOMIC_RELAXED);
+	io_set_state(IO_IDLE);
+
+	ret = event_start();
+	if (ret < 0)
+		return ret;
+
+	ret = recv_start();
+	if (ret < 0)
+		return ret;
+
+	ret = pthread_create(&bulk_pthread, NULL, bulk_thread, NULL);
+	if (ret < 0) {
+		perror ("can't create bulk thread");
+		return ret;
+	}
+
+	return 0;
+}
+
+static void stop_io(void)
+{
+	fprintf(stderr, "Stop bulk EPs\n");
+
+	if (bulk_in < 0 || bulk_out < 0)
+		return;
+
+	pthread_cancel(bulk_pthread);
+	pthread_join(bulk_pthread, NULL);
+	io_set_state(IO_STOPPED);
+	recv_stop();
+
+	event_stop();
+
+	status = PTP_WAITCONFIG;
+
+	close(bulk_out);
+	bulk_out = -EINVAL;
+	close(bulk_in);
+	bulk_in = -EINVAL;
+	close(interrupt);
+	interrupt = -EINVAL;
+}
+
+static int reset_interface(void)
+{
+	/* just reset toggle/halt for the interface's endpoints */
+	int err, parked;
+
+	if (status == PTP_WAITCONFIG)
+		return 0;
+
+	/* Park the bulk thread, it drops the current transaction */
+	pthread_mutex_lock(&io_lock);
+	io_post(IO_REQ_RESET);
+	parked = !io_wait_ack(io_parked);
+
+	err = ioctl(bulk_in, GADGETFS_CLEAR_HALT);
+	if (err < 0)
+		perror("reset source fd");
+
+	err = ioctl(bulk_out, GADGETFS_CLEAR_HALT);
+	if (err < 0)
+		perror("reset sink fd");
+
+	/*
+	 * Whatever the host has sent before the reset is stale. The ring may
+	 * only be flushed here with both threads parked, otherwise the bulk
+	 * thread does it, and drops its transaction, once it gets to it.
+	 */
+	if (parked) {
+		recv_flush();
+	} else {
+		fprintf(stderr, "bulk thread did not park for reset\n");
+		io_post(IO_REQ_FLUSH);
+	}
+	__atomic_store_n(&io_halted, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&device_status, PIMA15740_RESP_OK, __ATOMIC_RELAXED);
+
+	__atomic_and_fetch(&io_request, ~IO_REQ_RESET, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&io_cond);
+	pthread_mutex_unlock(&io_lock);
+
+	/* FIXME eventually reset the status endpoint too */
+
+	/* Always return "success"... */
+	return 0;
+}
+
+static void handle_control(struct usb_ctrlrequest *setup)
+{
+	int		err, tmp;
+	uint8_t		buf[256];
+	uint16_t	value, index, length;
+
+	value = __le16_to_cpu(setup->wValue);
+	index = __le16_to_cpu(setup->wIndex);
+	length = __le16_to_cpu(setup->wLength);
+
+	if (verbose)
+		fprintf(stderr, "SETUP %02x.%02x "
+				"v%04x i%04x %d\n",
+			setup->bRequestType, setup->bRequest,
+			value, index, length);
+
+	/*
+	if ((setup->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD)
 		goto special;
 	*/
 
-	switch (setup->bRequest) {	/* usb 2.0 spec ch9 requests */
-	case USB_REQ_GET_DESCRIPTOR:
-		if (setup->bRequestType != USB_DIR_IN)
-			goto stall;
-		switch (value >> 8) {
-		case USB_DT_STRING:
-			tmp = value & 0xff;
-			if (verbose > 1)
-				fprintf(stderr,
-					"... get string %d lang %04x\n",
-					tmp, index);
-			if (tmp != 0 && index != strings.language)
-				goto stall;
-			err = usb_gadget_get_string(&strings, tmp, buf);
-			if (err < 0)
-				goto stall;
-			tmp = err;
-			if (length < tmp)
-				tmp = length;
-			err = write(control, buf, tmp);
-			if (err < 0) {
-				if (errno == EIDRM)
-					fprintf(stderr, "string timeout\n");
-				else
-					perror("write string data");
-			} else if (err != tmp) {
-				fprintf(stderr, "short string write, %d\n",
-					err);
+	switch (setup->bRequest) {	/* usb 2.0 spec ch9 requests */
+	case USB_REQ_GET_DESCRIPTOR:
+		if (setup->bRequestType != USB_DIR_IN)
+			goto stall;
+		switch (value >> 8) {
+		case USB_DT_STRING:
+			tmp = value & 0xff;
+			if (verbose > 1)
+				fprintf(stderr,
+					"... get string %d lang %04x\n",
+					tmp, index);
+			if (tmp != 0 && index != strings.language)
+				goto stall;
+			err = usb_gadget_get_string(&strings, tmp, buf);
+			if (err < 0)
+				goto stall;
+			tmp = err;
+			if (length < tmp)
+				tmp = length;
+			err = write(control, buf, tmp);
+			if (err < 0) {
+				if (errno == EIDRM)
+					fprintf(stderr, "string timeout\n");
+				else
+					perror("write string data");
+			} else if (err != tmp) {
+				fprintf(stderr, "short string write, %d\n",
+					err);
+			}
+			break;
+		default:
+			goto stall;
+		}
+		return;
+	case USB_REQ_SET_CONFIGURATION:
+		if (setup->bRequestType != USB_DIR_OUT)
+			goto stall;
+		if (verbose)
+			fprintf(stderr, "CONFIG #%d\n", value);
+
+		/* Kernel is normally waiting for us to finish reconfiguring
+		 * the device.
+		 *
+		 * Some hardware can't, notably older PXA2xx hardware.  (With
+		 * racey and restrictive config change automagic.  PXA 255 is
+		 * OK, most PXA 250s aren't.  If it has a UDC CFR register,
+		 * it can handle deferred response for SET_CONFIG.)  To handle
+		 * such hardware, don't write code this way ... instead, keep
+		 * the endpoints always active and don't rely on seeing any
+		 * config change events, either this or SET_INTERFACE.
+		 */
+		switch (value) {
+		case CONFIG_VALUE:
+			if (profile) {
+				uint64_t t0 = prof_now();
+
+				prof_phase(PROF_CONFIG_WAIT, prof_config_start);
+				start_io();
+				prof_phase(PROF_START_IO, t0);
+				prof_report(object_number);
+				break;
+			}
+			start_io();
+			break;
+		case 0:
+			stop_io();
+			break;
+		default:
+			/* kernel bug -- "can't happen" */
+			fprintf(stderr, "? illegal config\n");
+			goto stall;
+		}
+
+		/* ... ack (a write would stall) */
+		err = read(control, &err, 0);
+		if (err)
+			perror("ack SET_CONFIGURATION");
+		return;
+	case USB_REQ_GET_INTERFACE:
+		if (setup->bRequestType != (USB_DIR_IN|USB_RECIP_INTERFACE)
+				|| index != 0
+				|| length > 1)
+			goto stall;
+
+		/* only one altsetting in this driver */
+		buf[0] = 0;
+		err = write(control, buf, length);
+		if (err < 0) {
+			if (errno == EIDRM)
+				fprintf(stderr, "GET_INTERFACE timeout\n");
+			else
+				perror("write GET_INTERFACE data");
+		} else if (err != length) {
+			fprintf(stderr, "short GET_INTERFACE write, %d\n",
+				err);
+		}
+		return;
+	case USB_REQ_SET_INTERFACE:
+		if (setup->bRequestType != USB_RECIP_INTERFACE
+				|| index != 0
+				|| value != 0)
+			goto stall;
+
+		err = reset_interface();
+		if (err)
+			goto stall;
+
+		/* ... and ack (a write would stall) */
+		err = read(control, &err, 0);
+		if (err)
+			perror("ack SET_INTERFACE");
+		return;
+	/* Still Image class-specific requests */
+	case USB_REQ_PTP_CANCEL_REQUEST:
+		if (setup->bRequestType != 0x21
+				|| value != 0
+				|| length != 6)
+			goto stall;
+
+		/* Data stage: CancellationCode and TransactionID */
+		err = read(control, buf, length);
+		if (err != length) {
+			fprintf(stderr, "CANCEL_REQUEST data %d\n", err);
+			return;
+		}
+		memcpy(&value, buf, sizeof(value));
+		if (__le16_to_cpu(value) == PIMA15740_EVENT_CANCEL_TRANSACTION) {
+			uint32_t id;
+
+			memcpy(&id, buf + 2, sizeof(id));
+			cancel_transaction(__le32_to_cpu(id));
+		}
+		return;
+	case USB_REQ_PTP_GET_EXTENDED_EVENT_DATA:
+		/* Optional, may stall */
+		goto stall;
+	case USB_REQ_PTP_DEVICE_RESET_REQUEST:
+		if (setup->bRequestType != 0x21
+				|| index != 0
+				|| value != 0)
+			goto stall;
+
+		err = reset_interface();
+		if (err)
+			goto stall;
+
+		/* ... and ack (a write would stall) */
+		err = read(control, &err, 0);
+		if (err)
+			perror("ack DEVICE_RESET_REQUEST");
+		return;
+	case USB_REQ_PTP_GET_DEVICE_STATUS_REQUEST:
+		if (setup->bRequestType != 0xa1
+				|| index != 0
+				|| value != 0)
+			goto stall;
+		else {
+			uint16_t resp[] = {
+				__constant_cpu_to_le16(4),
+				__cpu_to_le16(__atomic_load_n(&device_status, __ATOMIC_RELAXED)),
+			};
+			uint32_t ep = __cpu_to_le32(fs_source_desc.bEndpointAddress);
+
+			/* A halted endpoint follows as a parameter */
+			if (__atomic_load_n(&io_halted, __ATOMIC_ACQUIRE)) {
+				resp[0] = __cpu_to_le16(4 + sizeof(ep));
+				memcpy(buf + 4, &ep, sizeof(ep));
+			}
+			memcpy(buf, resp, 4);
+			tmp = min(__le16_to_cpu(resp[0]), length);
+			err = write(control, buf, tmp);
+			if (err != tmp)
+				fprintf(stderr, "DEVICE_STATUS_REQUEST %d\n", err);
+		}
+
+		return;
+	default:
+		goto stall;
+	}
+
+stall:
+	if (verbose)
+		fprintf(stderr, "... protocol stall %02x.%02x\n",
+			setup->bRequestType, setup->bRequest);
+
+	/* non-iso endpoints are stalled by issuing an i/o request
+	 * in the "wrong" direction.  ep0 is special only because
+	 * the direction isn't fixed.
+	 */
+	if (setup->bRequestType & USB_DIR_IN)
+		err = read(control, &err, 0);
+	else
+		err = write(control, &err, 0);
+	if (err != -1)
+		fprintf(stderr, "can't stall ep0 for %02x.%02x\n",
+			setup->bRequestType, setup->bRequest);
+	else if (errno != EL2HLT)
+		perror("ep0 stall");
+}
+
+static int read_control(void)
+{
+	struct usb_gadgetfs_event event[NEVENT];
+	int i, nevent, ret;
+
+	ret = read(control, &event, sizeof(event));
+	if (ret < 0) {
+		if (errno == EAGAIN) {
+			sleep(1);
+			return ret;
+		}
+		perror("ep0 read after poll");
+		return ret;
+	}
+	nevent = ret / sizeof event[0];
+
+	for (i = 0; i < nevent; i++) {
+		switch (event[i].type) {
+		case GADGETFS_NOP:
+			if (verbose)
+				fprintf(stderr, "NOP\n");
+			break;
+		case GADGETFS_CONNECT:
+			io_resume();
+			if (status != PTP_WAITCONFIG)
+				status = PTP_IDLE;
+			current_speed = event[i].u.speed;
+			if (verbose)
+				fprintf(stderr,
+					"CONNECT %s\n",
+				    speed(event[i].u.speed));
+			break;
+		case GADGETFS_SETUP:
+			io_resume();
+			if (status != PTP_WAITCONFIG)
+				status = PTP_IDLE;
+			handle_control(&event[i].u.setup);
+			break;
+		case GADGETFS_DISCONNECT:
+			if (verbose)
+				fprintf(stderr, "DISCONNECT\n");
+			__atomic_store_n(&suspended, 0, __ATOMIC_RELAXED);
+			stop_io();
+			status = PTP_WAITCONFIG;
+			current_speed = USB_SPEED_UNKNOWN;
+			break;
+		case GADGETFS_SUSPEND:
+			/*
+			 * Endpoints, session and the posted bulk-out read are
+			 * kept: the I/O threads stay blocked where they are
+			 * until the host resumes and carries on.
+			 */
+			if (verbose)
+				fprintf(stderr, "SUSPEND\n");
+			io_suspend();
+			break;
+		default:
+			fprintf(stderr,
+				"* unhandled event %d\n",
+				event[i].type);
+		}
+	}
+
+	return ret;
+}
+
+static int main_loop(void)
+{
+	struct pollfd ep_poll[1];
+	int ret;
+
+	do {
+		/* Always listen on control */
+		ep_poll[0].fd = control;
+		ep_poll[0].events = POLLIN | POLLHUP;
+
+		ret = poll(ep_poll, 1, -1);
+		if (ret < 0) {
+			perror("poll");
+			break;
+		}
+
+		/* TODO: What to do with HUP? */
+		if (ep_poll[0].revents & POLLIN) {
+			ret = read_control();
+			if (ret < 0) {
+				if (errno == EAGAIN)
+					continue;
+				goto done;
+			}
+		}
+	} while (1);
+
+	return 0;
+
+done:
+	switch (status) {
+	case PTP_IDLE:
+	case PTP_DATA_OUT:
+	case PTP_DATA_IN:
+	case PTP_DATA_READY:
+		stop_io();
+	case PTP_WAITCONFIG:
+		break;
+	}
+
+	return ret;
+}
+
+/*-------------------------------------------------------------------------*/
+
+static size_t put_string(iconv_t ic, char *buf, const char *s, size_t len)
+{
+	char *in = (char *)s;
+	size_t ret, inl = len, outl = len * 2;
+
+	ret = iconv(ic, &in, &inl, &buf, &outl);
+	if (inl || outl)
+		fprintf(stdout, "iconv() error %d: %u input / %u output bytes left!\n",
+			errno, inl, outl);
+
+	return ret;
+}
+
+/* Directory entries are collected and stat()'ed in batches of this size */
+#define SCAN_BATCH	64
+/* The directory is read with getdents64() into a buffer of this size */
+#define SCAN_DENTS_SIZE	(256 * 1024)
+/* Only what the object info and the thumbnail pack identity need */
+#define SCAN_STATX_MASK	(STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | \
+			 STATX_INO | STATX_SIZE | STATX_MTIME)
+
+struct scan_entry {
+	char		name[256];
+	struct stat	fstat;
+	int		fret;		/* 0 or -errno */
+	struct statx	fstx;
+	uint64_t	hash;		/* of the contents, 0 if unknown */
+	int		known;		/* identity found in the thumbnail pack */
+	void		*thumb;		/* made by thumb_work(), not yet in the pack */
+	size_t		thumb_len;
+	uint64_t	cost;		/* of the scan threads, when profiling */
+	int		thumb_shared;	/* another image has the same thumb_name() */
+};
+
+static void statx_to_stat(const struct statx *stx, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_dev	= makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino	= stx->stx_ino;
+	st->st_mode	= stx->stx_mode;
+	st->st_uid	= stx->stx_uid;
+	st->st_gid	= stx->stx_gid;
+	st->st_size	= stx->stx_size;
+	st->st_mtime	= stx->stx_mtime.tv_sec;
+}
+
+/*
+ * statx() a batch of images with a single io_uring_enter(). Returns -1 if
+ * there is no ring, the scan threads stat the entries themselves then.
+ */
+static int stat_batch(struct uring *ring, struct scan_entry *batch, int n)
+{
+	struct io_uring_cqe *cqe;
+	int i, ret;
+
+	if (ring->fd < 0)
+		return -1;
+
+	for (i = 0; i < n; i++)
+		uring_prep_statx(uring_get_sqe(ring), root_fd, batch[i].name, 0,
+				 SCAN_STATX_MASK, &batch[i].fstx, i);
+
+	ret = uring_submit(ring, n);
+	if (!ret) {
+		while ((cqe = uring_peek_cqe(ring))) {
+			struct scan_entry *e = batch + cqe->user_data;
+
+			e->fret = cqe->res;
+			if (!e->fret)
+				statx_to_stat(&e->fstx, &e->fstat);
+			uring_cqe_seen(ring);
+		}
+		return 0;
+	}
+
+	/* The ring is broken, stop using it */
+	fprintf(stderr, "io_uring statx: %s, falling back\n", strerror(-ret));
+	uring_drain(ring);
+	uring_exit(ring);
+
+	return -1;
+}
+
+static void stat_entry(struct scan_entry *e)
+{
+	uint64_t t0 = prof_now();
+
+	e->fret = statx(root_fd, e->name, 0, SCAN_STATX_MASK, &e->fstx) < 0 ? -errno : 0;
+	if (!e->fret)
+		statx_to_stat(&e->fstx, &e->fstat);
+	prof_file(PROF_FILE_STAT, e->name, t0);
+}
+
+static int scan_is_image(const char *name)
+{
+	const char *dot = strrchr(name, '.');
+
+	if (!dot || dot == name)
+		return 0;
+
+	return !strcasecmp(dot, ".tif") || !strcasecmp(dot, ".tiff") ||
+		!strcasecmp(dot, ".jpg") || !strcasecmp(dot, ".jpeg");
+}
+
+static int scan_is_jpeg(const char *name)
+{
+	const char *dot = strrchr(name, '.');
+
+	return dot && (!strcasecmp(dot, ".jpg") || !strcasecmp(dot, ".jpeg"));
+}
+
+struct linux_dirent64 {
+	uint64_t	d_ino;
+	int64_t		d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char		d_name[];
+};
+
+/* Image names of the base directory, sorted, so that handles don't depend on readdir order */
+struct scan_list {
+	char		*names;		/* '\0' separated */
+	size_t		len, size;
+	char		**name;
+	uint8_t		*shared;	/* the name's thumb_name() is another's too */
+	int		n;
+};
+
+static int scan_name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static size_t scan_base_len(const char *name)
+{
+	const char *dot = strrchr(name, '.');
+
+	return dot ? dot - name : strlen(name);
+}
+
+static int scan_base_cmp(const void *a, const void *b)
+{
+	const char *na = *(char * const *)a, *nb = *(char * const *)b;
+	size_t la = scan_base_len(na), lb = scan_base_len(nb);
+	int ret = strncmp(na, nb, min(la, lb));
+
+	return ret ? ret : (la > lb) - (la < lb);
+}
+
+/* Find the names, which only differ in their extension, like IMG_1.jpg and IMG_1.tif */
+static int scan_mark_shared(struct scan_list *l)
+{
+	char **v, **p;
+	int i;
+
+	l->shared = calloc(l->n + 1, 1);
+	v = malloc((l->n + 1) * sizeof(*v));
+	if (!l->shared || !v) {
+		free(l->shared);
+		free(v);
+		return -1;
+	}
+
+	memcpy(v, l->name, l->n * sizeof(*v));
+	qsort(v, l->n, sizeof(*v), scan_base_cmp);
+	for (i = 1; i < l->n; i++) {
+		if (scan_base_cmp(v + i - 1, v + i))
+			continue;
+		p = bsearch(v + i - 1, l->name, l->n, sizeof(*v), scan_name_cmp);
+		l->shared[p - l->name] = 1;
+		p = bsearch(v + i, l->name, l->n, sizeof(*v), scan_name_cmp);
+		l->shared[p - l->name] = 1;
+	}
+
+	free(v);
+	return 0;
+}
+
+static int scan_list(struct scan_list *l)
+{
+	struct linux_dirent64 *d;
+	char *buf, *names, *p;
+	size_t len;
+	long ret;
+	int fd, i;
+
+	memset(l, 0, sizeof(*l));
+
+	fd = openat(root_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	buf = malloc(SCAN_DENTS_SIZE);
+	if (!buf) {
+		close(fd);
+		return -1;
+	}
+
+	while ((ret = syscall(SYS_getdents64, fd, buf, SCAN_DENTS_SIZE)) > 0) {
+		for (p = buf; p < buf + ret; p += d->d_reclen) {
+			d = (struct linux_dirent64 *)p;
+
+			/* Symbolic links and unknown types are checked by statx() */
+			if (d->d_type != DT_REG && d->d_type != DT_LNK &&
+			    d->d_type != DT_UNKNOWN)
+				continue;
+			if (!scan_is_image(d->d_name))
+				continue;
+
+			len = strlen(d->d_name) + 1;
+			if (l->len + len > l->size) {
+				names = realloc(l->names, max(2 * l->size, (size_t)SCAN_DENTS_SIZE));
+				if (!names)
+					goto fail;
+				l->names = names;
+				l->size = max(2 * l->size, (size_t)SCAN_DENTS_SIZE);
 			}
-			break;
-		default:
-			goto stall;
+			memcpy(l->names + l->len, d->d_name, len);
+			l->len += len;
+			l->n++;
 		}
-		return;
-	case USB_REQ_SET_CONFIGURATION:
-		if (setup->bRequestType != USB_DIR_OUT)
-			goto stall;
-		if (verbose)
-			fprintf(stderr, "CONFIG #%d\n", value);
+	}
 
-		/* Kernel is normally waiting for us to finish reconfiguring
-		 * the device.
-		 *
-		 * Some hardware can't, notably older PXA2xx hardware.  (With
-		 * racey and restrictive config change automagic.  PXA 255 is
-		 * OK, most PXA 250s aren't.  If it has a UDC CFR register,
-		 * it can handle deferred response for SET_CONFIG.)  To handle
-		 * such hardware, don't write code this way ... instead, keep
-		 * the endpoints always active and don't rely on seeing any
-		 * config change events, either this or SET_INTERFACE.
-		 */
-		switch (value) {
-		case CONFIG_VALUE:
-			start_io();
-			break;
-		case 0:
-			stop_io();
-			break;
-		default:
-			/* kernel bug -- "can't happen" */
-			fprintf(stderr, "? illegal config\n");
-			goto stall;
-		}
+	/* Go on with what could be read */
+	if (ret < 0)
+		perror("getdents64");
 
-		/* ... ack (a write would stall) */
-		err = read(control, &err, 0);
-		if (err)
-			perror("ack SET_CONFIGURATION");
-		return;
-	case USB_REQ_GET_INTERFACE:
-		if (setup->bRequestType != (USB_DIR_IN|USB_RECIP_INTERFACE)
-				|| index != 0
-				|| length > 1)
-			goto stall;
+	l->name = malloc((l->n + 1) * sizeof(*l->name));
+	if (!l->name)
+		goto fail;
 
-		/* only one altsetting in this driver */
-		buf[0] = 0;
-		err = write(control, buf, length);
-		if (err < 0) {
-			if (errno == EIDRM)
-				fprintf(stderr, "GET_INTERFACE timeout\n");
-			else
-				perror("write GET_INTERFACE data");
-		} else if (err != length) {
-			fprintf(stderr, "short GET_INTERFACE write, %d\n",
-				err);
+	for (i = 0, p = l->names; i < l->n; i++, p += strlen(p) + 1)
+		l->name[i] = p;
+	qsort(l->name, l->n, sizeof(*l->name), scan_name_cmp);
+
+	if (scan_mark_shared(l) < 0) {
+		free(l->name);
+		goto fail;
+	}
+
+	free(buf);
+	close(fd);
+	return 0;
+
+fail:
+	free(l->names);
+	free(buf);
+	close(fd);
+	return -1;
+}
+
+/*
+ * Content hash: FNV-1a of the size, the first and the last CONTENT_HASH_SPAN
+ * bytes and CONTENT_HASH_SAMPLES blocks in between. Uncompressed images of
+ * one size can differ only in between the samples, for them the inode and
+ * mtime are hashed too, so that only a rename keeps their thumbnail.
+ */
+#define CONTENT_HASH_SPAN	(64 * 1024)
+#define CONTENT_HASH_SAMPLES	8
+#define CONTENT_HASH_BLOCK	4096
+
+static uint64_t fnv1a(uint64_t h, const uint8_t *p, size_t len)
+{
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+static int hash_range(int fd, uint64_t *h, off_t pos, off_t len)
+{
+	uint8_t buf[CONTENT_HASH_BLOCK];
+	ssize_t ret;
+
+	for (; len > 0; pos += ret, len -= ret) {
+		ret = pread(fd, buf, min((off_t)sizeof(buf), len), pos);
+		if (ret <= 0)
+			return -1;
+		*h = fnv1a(*h, buf, ret);
+	}
+
+	return 0;
+}
+
+static uint64_t content_hash(const char *name, const struct stat *st)
+{
+	uint64_t h = 0xcbf29ce484222325ULL, s = st->st_size, id[2];
+	off_t size = st->st_size, head, mid;
+	int fd, i, ret;
+
+	fd = openat(root_fd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	h = fnv1a(h, (uint8_t *)&s, sizeof(s));
+	if (!scan_is_jpeg(name)) {
+		id[0] = st->st_ino;
+		id[1] = st->st_mtime;
+		h = fnv1a(h, (uint8_t *)id, sizeof(id));
+	}
+
+	head = min(size, (off_t)CONTENT_HASH_SPAN);
+	ret = hash_range(fd, &h, 0, head);
+
+	/* The samples are spread evenly over what lies between the spans */
+	mid = size - head - CONTENT_HASH_SPAN;
+	for (i = 1; !ret && mid > 0 && i <= CONTENT_HASH_SAMPLES; i++)
+		ret = hash_range(fd, &h, head + mid * i / (CONTENT_HASH_SAMPLES + 1),
+				 min(mid / (CONTENT_HASH_SAMPLES + 1), (off_t)CONTENT_HASH_BLOCK));
+
+	if (!ret && size > head)
+		ret = hash_range(fd, &h, max(head, size - CONTENT_HASH_SPAN),
+				 size - max(head, size - CONTENT_HASH_SPAN));
+	close(fd);
+
+	if (ret < 0)
+		return 0;
+
+	/* 0 means no thumbnail */
+	return h ? h : 1;
+}
+
+/* Read and remove a thumbnail file, left by convert or by an older version */
+static void *thumb_file_take(const char *thumb, size_t *len)
+{
+	void *data = NULL;
+	struct stat st;
+	int fd;
+
+	fd = openat(thumb_fd, thumb, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (!fstat(fd, &st) && st.st_size > 0 && (data = malloc(st.st_size))) {
+		if (pread(fd, data, st.st_size, 0) == st.st_size) {
+			*len = st.st_size;
+		} else {
+			free(data);
+			data = NULL;
 		}
-		return;
-	case USB_REQ_SET_INTERFACE:
-		if (setup->bRequestType != USB_RECIP_INTERFACE
-				|| index != 0
-				|| value != 0)
-			goto stall;
+	}
+	close(fd);
+	unlinkat(thumb_fd, thumb, 0);
 
-		err = reset_interface();
-		if (err)
-			goto stall;
+	return data;
+}
 
-		/* ... and ack (a write would stall) */
-		err = read(control, &err, 0);
-		if (err)
-			perror("ack SET_INTERFACE");
-		return;
-	/* Still Image class-specific requests */
-	case USB_REQ_PTP_CANCEL_REQUEST:
-		return;
-	case USB_REQ_PTP_GET_EXTENDED_EVENT_DATA:
-		/* Optional, may stall */
-		goto stall;
-	case USB_REQ_PTP_DEVICE_RESET_REQUEST:
-		if (setup->bRequestType != 0x21
-				|| index != 0
-				|| value != 0)
-			goto stall;
+#ifndef NO_LIBJPEG
+/*
+ * In-process JPEG thumbnailer: the image is decoded at 1/8 scale in the DCT
+ * domain, area-averaged down to fit THUMB_WIDTH x THUMB_HEIGHT and encoded as
+ * JFIF. Returns NULL for anything libjpeg cannot convert to RGB, the caller
+ * falls back to convert then.
+ */
+#define THUMB_JPEG_MAX	(THUMB_WIDTH * THUMB_HEIGHT * 3 + 4096)
 
-		err = reset_interface();
-		if (err)
-			goto stall;
+struct jpeg_error {
+	struct jpeg_error_mgr	mgr;
+	jmp_buf			env;
+};
 
-		/* ... and ack (a write would stall) */
-		err = read(control, &err, 0);
-		if (err)
-			perror("ack DEVICE_RESET_REQUEST");
-		return;
-	case USB_REQ_PTP_GET_DEVICE_STATUS_REQUEST:
-		if (setup->bRequestType != 0xa1
-				|| index != 0
-				|| value != 0)
-			goto stall;
-		else {
-			uint16_t resp_ok[] = {
-				__constant_cpu_to_le16(4),
-				__constant_cpu_to_le16(PIMA15740_RESP_OK),
-			};
-			memcpy(buf, resp_ok, 4);
-			err = write(control, buf, 4);
-			if (err != 4)
-				fprintf(stderr, "DEVICE_STATUS_REQUEST %d\n", err);
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	longjmp(((struct jpeg_error *)cinfo->err)->env, 1);
+}
+
+/* Fit a w x h image into the thumbnail size, preserving aspect ratio */
+static void thumb_fit(unsigned int w, unsigned int h, unsigned int *tw, unsigned int *th)
+{
+	if ((unsigned long)w * THUMB_HEIGHT > (unsigned long)h * THUMB_WIDTH) {
+		*tw = THUMB_WIDTH;
+		*th = (unsigned long)h * THUMB_WIDTH / w;
+	} else {
+		*th = THUMB_HEIGHT;
+		*tw = (unsigned long)w * THUMB_HEIGHT / h;
+	}
+	if (!*tw)
+		*tw = 1;
+	if (!*th)
+		*th = 1;
+}
+
+static void thumb_resample(const uint8_t *src, unsigned int w, unsigned int h,
+			   uint8_t *dst, unsigned int tw, unsigned int th)
+{
+	unsigned int x, y, sx, sy, x0, x1, y0, y1, c;
+
+	for (y = 0; y < th; y++) {
+		y0 = y * h / th;
+		y1 = max((y + 1) * h / th, y0 + 1);
+		for (x = 0; x < tw; x++) {
+			unsigned long sum[3] = { 0, 0, 0 }, n;
+
+			x0 = x * w / tw;
+			x1 = max((x + 1) * w / tw, x0 + 1);
+			for (sy = y0; sy < y1; sy++)
+				for (sx = x0; sx < x1; sx++)
+					for (c = 0; c < 3; c++)
+						sum[c] += src[(sy * w + sx) * 3 + c];
+
+			n = (y1 - y0) * (x1 - x0);
+			for (c = 0; c < 3; c++)
+				*dst++ = (sum[c] + n / 2) / n;
 		}
+	}
+}
+
+static void *jpeg_thumbnail(const char *name, size_t *len)
+{
+	struct jpeg_decompress_struct d;
+	struct jpeg_compress_struct c;
+	struct jpeg_error err;
+	uint8_t *volatile pixels = NULL, *volatile thumb = NULL;
+	unsigned char *buf, *out;
+	unsigned long out_size = THUMB_JPEG_MAX;
+	void *volatile ret = NULL;
+	unsigned int w, h, tw, th;
+	JSAMPROW row;
+	FILE *f;
+	int fd;
+
+	fd = openat(root_fd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	f = fdopen(fd, "rb");
+	if (!f) {
+		close(fd);
+		return NULL;
+	}
+
+	/* Encoded into our own buffer, libjpeg only allocates if it overflows */
+	out = buf = malloc(THUMB_JPEG_MAX);
+	if (!buf) {
+		fclose(f);
+		return NULL;
+	}
+
+	memset(&d, 0, sizeof(d));
+	memset(&c, 0, sizeof(c));
+	d.err = jpeg_std_error(&err.mgr);
+	c.err = &err.mgr;
+	err.mgr.error_exit = jpeg_error_exit;
+	if (setjmp(err.env))
+		goto out;
+
+	jpeg_create_decompress(&d);
+	jpeg_create_compress(&c);
+
+	jpeg_stdio_src(&d, f);
+	jpeg_read_header(&d, TRUE);
+	if (d.jpeg_color_space == JCS_CMYK || d.jpeg_color_space == JCS_YCCK)
+		goto out;
+
+	d.scale_num		= 1;
+	d.scale_denom		= 8;
+	d.out_color_space	= JCS_RGB;
+	d.dct_method		= JDCT_IFAST;
+	jpeg_start_decompress(&d);
+
+	w = d.output_width;
+	h = d.output_height;
+	pixels = malloc((size_t)w * h * 3);
+	if (!pixels)
+		goto out;
+	while (d.output_scanline < h) {
+		row = pixels + (size_t)d.output_scanline * w * 3;
+		jpeg_read_scanlines(&d, &row, 1);
+	}
+	jpeg_finish_decompress(&d);
+
+	thumb_fit(w, h, &tw, &th);
+	thumb = malloc(tw * th * 3);
+	if (!thumb)
+		goto out;
+	thumb_resample(pixels, w, h, thumb, tw, th);
+
+	jpeg_mem_dest(&c, &out, &out_size);
+	c.image_width		= tw;
+	c.image_height		= th;
+	c.input_components	= 3;
+	c.in_color_space	= JCS_RGB;
+	jpeg_set_defaults(&c);
+	jpeg_set_quality(&c, 75, TRUE);
+	jpeg_start_compress(&c, TRUE);
+	while (c.next_scanline < th) {
+		row = thumb + c.next_scanline * tw * 3;
+		jpeg_write_scanlines(&c, &row, 1);
+	}
+	jpeg_finish_compress(&c);
+
+	*len = out_size;
+	ret = out;
+	if (out != buf)
+		free(buf);
+	buf = NULL;
+
+out:
+	jpeg_destroy_compress(&c);
+	jpeg_destroy_decompress(&d);
+	free(buf);
+	free(thumb);
+	free(pixels);
+	fclose(f);
+
+	return ret;
+}
+#else
+static void *jpeg_thumbnail(const char *name, size_t *len)
+{
+	return NULL;
+}
+#endif
+
+/*
+ * Make a thumbnail, or import the file of a version without the pack, unless
+ * another image maps to the same thumbnail file name. Runs in parallel.
+ */
+static void *thumb_generate(const char *name, const struct stat *st, int import,
+			    size_t *len)
+{
+	char thumb[256], path[PATH_MAX];
+	struct stat tst;
+	pid_t converter;
+	uint64_t t0;
+	void *data;
+	int status, ret, fd;
+
+	if (import && !thumb_name(thumb, sizeof(thumb), name)) {
+		t0 = prof_now();
+		ret = fstatat(thumb_fd, thumb, &tst, 0);
+		prof_file(PROF_FILE_THUMB_STAT, name, t0);
+		if (!ret && tst.st_mtime >= st->st_mtime)
+			return thumb_file_take(thumb, len);
+	}
+
+	if (verbose)
+		fprintf(stderr, "No or old thumbnail for %s\n", name);
+
+	/* JPEG is thumbnailed in-process, everything else by convert */
+	if (scan_is_jpeg(name)) {
+		t0 = prof_now();
+		data = jpeg_thumbnail(name, len);
+		prof_file(PROF_FILE_JPEG, name, t0);
+		if (data)
+			return data;
+	}
+
+	/* A name of its own, convert runs for several images at a time */
+	snprintf(path, sizeof(path), THUMB_LOCATION ".convert-XXXXXX.jpeg");
+	fd = mkostemps(path, sizeof(".jpeg") - 1, O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	close(fd);
+
+	t0 = prof_now();
+	converter = fork();
+	if (converter < 0) {
+		unlink(path);
+		return NULL;
+	}
+
+	if (!converter) {
+		if (!fchdir(root_fd))
+			execlp("convert", "convert", "-thumbnail", THUMB_SIZE,
+			       name, path, NULL);
+		_exit(EXIT_FAILURE);
+	}
+
+	waitpid(converter, &status, 0);
+	prof_file(PROF_FILE_CONVERT, name, t0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		unlink(path);
+		return NULL;
+	}
+
+	return thumb_file_take(path + strlen(THUMB_LOCATION), len);
+}
+
+static void pack_identity(struct pack_rec *rec, const struct stat *st)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->dev	= st->st_dev;
+	rec->ino	= st->st_ino;
+	rec->size	= st->st_size;
+	rec->mtime	= st->st_mtime;
+}
 
+/* Look the image up in the pack and make its thumbnail if missing, runs in parallel */
+static void thumb_work(struct scan_entry *e)
+{
+	struct pack_rec rec;
+	uint64_t t0;
+
+	e->hash = 0;
+	e->thumb = NULL;
+	if (e->fret < 0 || !S_ISREG(e->fstat.st_mode))
 		return;
-	default:
-		goto stall;
+
+	pack_identity(&rec, &e->fstat);
+	e->hash = pack_find_id(&rec);
+	e->known = !!e->hash;
+	if (!e->hash) {
+		t0 = prof_now();
+		e->hash = content_hash(e->name, &e->fstat);
+		prof_file(PROF_FILE_HASH, e->name, t0);
 	}
 
-stall:
-	if (verbose)
-		fprintf(stderr, "... protocol stall %02x.%02x\n",
-			setup->bRequestType, setup->bRequest);
+	if (e->hash && !pack_find(e->hash))
+		e->thumb = thumb_generate(e->name, &e->fstat, !e->thumb_shared,
+					  &e->thumb_len);
+}
 
-	/* non-iso endpoints are stalled by issuing an i/o request
-	 * in the "wrong" direction.  ep0 is special only because
-	 * the direction isn't fixed.
-	 */
-	if (setup->bRequestType & USB_DIR_IN)
-		err = read(control, &err, 0);
-	else
-		err = write(control, &err, 0);
-	if (err != -1)
-		fprintf(stderr, "can't stall ep0 for %02x.%02x\n",
-			setup->bRequestType, setup->bRequest);
-	else if (errno != EL2HLT)
-		perror("ep0 stall");
+/* Add what thumb_work() has found or made to the pack, returns the thumbnail size */
+static int thumb_finish(struct scan_entry *e)
+{
+	struct pack_thumb *t;
+	struct pack_rec rec;
+
+	if (!e->hash)
+		return -1;
+
+	pack_identity(&rec, &e->fstat);
+	rec.hash = e->hash;
+
+	/* Copies within one batch have all made a thumbnail, the first one wins */
+	t = pack_find(e->hash);
+	if (t) {
+		/* A renamed or a copied image, remember its identity */
+		if (!e->known)
+			pack_append(&rec, NULL);
+	} else if (e->thumb) {
+		rec.len = e->thumb_len;
+		if (!pack_append(&rec, e->thumb))
+			t = pack_find(e->hash);
+	}
+
+	free(e->thumb);
+	e->thumb = NULL;
+	if (!t)
+		return -1;
+
+	t->refs++;
+
+	return t->len;
 }
 
-static int read_control(void)
+/*
+ * Images are stat()'ed, unless io_uring has done that, and thumbnails looked
+ * up and made by a pool of scan threads, one per additional CPU, working
+ * through a batch of directory entries together with the main thread. The
+ * pack is only read while the pool is busy.
+ */
+#define SCAN_THREADS_MAX	16
+
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_t		threads[SCAN_THREADS_MAX];
+	int			nthreads;
+	struct scan_entry	*batch;
+	int			n, next, active, seq, quit, stat;
+} scan_pool = {
+	.lock	= PTHREAD_MUTEX_INITIALIZER,
+	.cond	= PTHREAD_COND_INITIALIZER,
+};
+
+/* Called with scan_pool.lock held */
+static void scan_pool_work(void)
 {
-	struct usb_gadgetfs_event event[NEVENT];
-	int i, nevent, ret;
+	uint64_t t0;
+	int i;
 
-	ret = read(control, &event, sizeof(event));
-	if (ret < 0) {
-		if (errno == EAGAIN) {
-			sleep(1);
-			return ret;
-		}
-		perror("ep0 read after poll");
-		return ret;
+	scan_pool.active++;
+	while (scan_pool.next < scan_pool.n) {
+		i = scan_pool.next++;
+		pthread_mutex_unlock(&scan_pool.lock);
+		t0 = prof_now();
+		if (scan_pool.stat)
+			stat_entry(scan_pool.batch + i);
+		thumb_work(scan_pool.batch + i);
+		scan_pool.batch[i].cost = prof_now() - t0;
+		pthread_mutex_lock(&scan_pool.lock);
 	}
-	nevent = ret / sizeof event[0];
+	if (!--scan_pool.active)
+		pthread_cond_broadcast(&scan_pool.cond);
+}
 
-	for (i = 0; i < nevent; i++) {
-		switch (event[i].type) {
-		case GADGETFS_NOP:
-			if (verbose)
-				fprintf(stderr, "NOP\n");
-			break;
-		case GADGETFS_CONNECT:
-			if (status != PTP_WAITCONFIG)
-				status = PTP_IDLE;
-			current_speed = event[i].u.speed;
-			if (verbose)
-				fprintf(stderr,
-					"CONNECT %s\n",
-				    speed(event[i].u.speed));
-			break;
-		case GADGETFS_SETUP:
-			if (status != PTP_WAITCONFIG)
-				status = PTP_IDLE;
-			handle_control(&event[i].u.setup);
-			break;
-		case GADGETFS_DISCONNECT:
-			status = PTP_WAITCONFIG;
-			current_speed = USB_SPEED_UNKNOWN;
-			if (verbose)
-				fprintf(stderr, "DISCONNECT\n");
-			break;
-		case GADGETFS_SUSPEND:
-			if (verbose)
-				fprintf(stderr, "SUSPEND\n");
-			stop_io();
+static void *scan_thread(void *param)
+{
+	int seq = 0;
+
+	pthread_mutex_lock(&scan_pool.lock);
+	for (;;) {
+		while (!scan_pool.quit && scan_pool.seq == seq)
+			pthread_cond_wait(&scan_pool.cond, &scan_pool.lock);
+		if (scan_pool.quit)
 			break;
-		default:
-			fprintf(stderr,
-				"* unhandled event %d\n",
-				event[i].type);
-		}
+		seq = scan_pool.seq;
+		scan_pool_work();
 	}
+	pthread_mutex_unlock(&scan_pool.lock);
 
-	return ret;
+	return NULL;
 }
 
-static int main_loop(void)
+static void scan_pool_start(void)
 {
-	struct pollfd ep_poll[1];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
 	int ret;
 
-	do {
-		/* Always listen on control */
-		ep_poll[0].fd = control;
-		ep_poll[0].events = POLLIN | POLLHUP;
-
-		ret = poll(ep_poll, 1, -1);
-		if (ret < 0) {
-			perror("poll");
+	while (scan_pool.nthreads < min(cpus - 1, (long)SCAN_THREADS_MAX)) {
+		ret = pthread_create(scan_pool.threads + scan_pool.nthreads, NULL,
+				     scan_thread, NULL);
+		if (ret) {
+			/* The main thread does it all, if need be */
+			errno = ret;
+			perror("can't create scan thread");
 			break;
 		}
+		scan_pool.nthreads++;
+	}
+}
 
-		/* TODO: What to do with HUP? */
-		if (ep_poll[0].revents & POLLIN) {
-			ret = read_control();
-			if (ret < 0) {
-				if (errno == EAGAIN)
-					continue;
-				goto done;
-			}
-		}
-	} while (1);
-
-	return 0;
+static void scan_pool_stop(void)
+{
+	pthread_mutex_lock(&scan_pool.lock);
+	scan_pool.quit = 1;
+	pthread_cond_broadcast(&scan_pool.cond);
+	pthread_mutex_unlock(&scan_pool.lock);
 
-done:
-	switch (status) {
-	case PTP_IDLE:
-	case PTP_DATA_OUT:
-	case PTP_DATA_IN:
-	case PTP_DATA_READY:
-		stop_io();
-	case PTP_WAITCONFIG:
-		break;
-	}
+	while (scan_pool.nthreads)
+		pthread_join(scan_pool.threads[--scan_pool.nthreads], NULL);
+}
 
-	return ret;
+static void scan_pool_run(struct scan_entry *batch, int n, int stat)
+{
+	pthread_mutex_lock(&scan_pool.lock);
+	scan_pool.batch	= batch;
+	scan_pool.n	= n;
+	scan_pool.stat	= stat;
+	scan_pool.next	= 0;
+	scan_pool.seq++;
+	pthread_cond_broadcast(&scan_pool.cond);
+
+	scan_pool_work();
+	while (scan_pool.active)
+		pthread_cond_wait(&scan_pool.cond, &scan_pool.lock);
+	pthread_mutex_unlock(&scan_pool.lock);
 }
 
-/*-------------------------------------------------------------------------*/
+static int obj_handle_cmp(const void *a, const void *b)
+{
+	uint32_t ha = (*(struct obj_list * const *)a)->handle;
+	uint32_t hb = (*(struct obj_list * const *)b)->handle;
 
-static size_t put_string(iconv_t ic, char *buf, const char *s, size_t len)
+	return ha < hb ? -1 : ha > hb;
+}
+
+/* Hosts, and the prefetcher, expect the handles in ascending order */
+static void sort_images(int count)
 {
-	char *in = (char *)s;
-	size_t ret, inl = len, outl = len * 2;
+	struct obj_list **v, *obj;
+	int i;
 
-	ret = iconv(ic, &in, &inl, &buf, &outl);
-	if (inl || outl)
-		fprintf(stdout, "iconv() error %d: %u input / %u output bytes left!\n",
-			errno, inl, outl);
+	v = malloc(count * sizeof(*v));
+	if (!v)
+		return;
 
-	return ret;
+	for (i = 0, obj = images; obj; obj = obj->next)
+		v[i++] = obj;
+	qsort(v, count, sizeof(*v), obj_handle_cmp);
+
+	for (i = 0; i < count; i++)
+		v[i]->next = i + 1 < count ? v[i + 1] : NULL;
+	images = count ? v[0] : NULL;
+
+	free(v);
 }
 
-static int enum_objects(const char *path)
+static int enum_objects(void)
 {
-	struct dirent *dentry;
-	char /*creat[32], creat_ucs2[64], */mod[32], mod_ucs2[64], fname_ucs2[512],
-		thumb[256];
-	DIR *d;
-	int ret;
+	static const __u8 scan_ops[] = { IORING_OP_STATX };
+	struct scan_entry *batch;
+	struct scan_list list;
+	struct uring ring = { .fd = -1 };
+	int ret, i, n, next;
 	struct obj_list **obj = &images;
-	/* First two handles used for /DCIM/PTP_MODEL_DIR */
-	uint32_t handle = 2;
+	/* Handles are kept across runs, the list is sorted by handle once complete */
+	uint32_t handle;
+	uint64_t t0, t1, t2;
+	int count = 0;
 
-	ret = chdir(path);
+	t0 = prof_now();
+	ret = scan_list(&list);
+	prof_phase(PROF_SCAN_LIST, t0);
 	if (ret < 0)
-		return ret;
-
-	d = opendir(".");
-
-	while ((dentry = readdir(d))) {
-		struct stat fstat, tstat;
-		char *dot;
-		size_t namelen, datelen, osize;
-		enum pima15740_data_format format;
-		struct tm mod_tm;
+		return -1;
 
-		dot = strrchr(dentry->d_name, '.');
+	batch = malloc(SCAN_BATCH * sizeof(*batch));
+	if (!batch) {
+		free(list.shared);
+		free(list.name);
+		free(list.names);
+		return -1;
+	}
 
-		if (!dot || dot == dentry->d_name)
-			continue;
+	if (use_uring) {
+		ret = uring_init(&ring, 2 * SCAN_BATCH, scan_ops, ARRAY_SIZE(scan_ops));
+		if (ret < 0 && verbose)
+			fprintf(stderr, "No io_uring for scanning: %s\n", strerror(-ret));
+	}
+	ret = 0;
 
-		if (strcasecmp(dot, ".tif") &&
-		    strcasecmp(dot, ".tiff") &&
-		    strcasecmp(dot, ".jpg") &&
-		    strcasecmp(dot, ".jpeg"))
-			continue;
+	scan_pool_start();
 
-		/* TODO: use identify from ImageMagick and parse its output */
-		switch (dot[1]) {
-		case 't':
-		case 'T':
-			format = PIMA15740_FMT_I_TIFF;
-			break;
-		case 'j':
-		case 'J':
-			format = PIMA15740_FMT_I_EXIF_JPEG;
-			break;
-		default:
-			format = PIMA15740_FMT_I_UNDEFINED;
+	for (next = 0; next < list.n; next += n) {
+		n = min(list.n - next, SCAN_BATCH);
+		for (i = 0; i < n; i++) {
+			strncpy(batch[i].name, list.name[next + i], sizeof(batch[i].name));
+			batch[i].thumb_shared = list.shared[next + i];
 		}
 
-		ret = stat(dentry->d_name, &fstat);
-		if (ret < 0)
-			break;
-
-		namelen = strlen(dentry->d_name) + 1;
-
-		ret = put_string(ic, fname_ucs2, dentry->d_name, namelen);
-		if (ret)
-			break;
+		t0 = prof_now();
+		ret = stat_batch(&ring, batch, n);
+		if (!ret)
+			prof_phase(PROF_SCAN_STATX, t0);
+		t0 = prof_now();
+		scan_pool_run(batch, n, ret < 0);
+		prof_phase(PROF_SCAN_THUMBS, t0);
+		ret = 0;
+
+		t0 = prof_now();
+		for (i = 0; i < n; i++) {
+			struct scan_entry *e = batch + i;
+			int thumb_size;
+			char *dot;
+			enum pima15740_data_format format;
+
+			t1 = prof_now();
+			dot = strrchr(e->name, '.');
+
+			/* TODO: use identify from ImageMagick and parse its output */
+			switch (dot[1]) {
+			case 't':
+			case 'T':
+				format = PIMA15740_FMT_I_TIFF;
+				break;
+			case 'j':
+			case 'J':
+				format = PIMA15740_FMT_I_EXIF_JPEG;
+				break;
+			default:
+				format = PIMA15740_FMT_I_UNDEFINED;
+			}
 
-		gmtime_r(&fstat.st_mtime, &mod_tm);
-		snprintf(mod, sizeof(mod),"%04u%02u%02uT%02u%02u%02u.0Z",
-			 mod_tm.tm_year + 1900, mod_tm.tm_mon + 1,
-			 mod_tm.tm_mday, mod_tm.tm_hour,
-			 mod_tm.tm_min, mod_tm.tm_sec);
+			/* Unreadable entries are skipped, not the rest of the directory */
+			if (e->fret < 0 || !S_ISREG(e->fstat.st_mode)) {
+				if (verbose)
+					fprintf(stderr, "Skipping %s: %s\n", e->name,
+						e->fret < 0 ? strerror(-e->fret) : "not a regular file");
+				continue;
+			}
 
-		/* String length including the trailing '\0' */
-		datelen = strlen(mod) + 1;
-		ret = put_string(ic, mod_ucs2, mod, datelen);
-		if (ret) {
-			mod[0] = '\0';
-			datelen = 0;
-		}
-
-		/* Put thumbnails under /var/cache/ptp/thumb/
-		 * and call them <filename>.thumb.<extension> */
-		*dot = '\0';
-		snprintf(thumb, sizeof(thumb), THUMB_LOCATION "%s.thumb.jpeg",
-			 dentry->d_name);
-		*dot = '.';
-		if (stat(thumb, &tstat) < 0 || tstat.st_mtime < fstat.st_mtime) {
-			pid_t converter;
-			if (verbose)
-				fprintf(stderr, "No or old thumbnail for %s\n", dentry->d_name);
-			converter = fork();
-			if (converter < 0) {
+			t2 = prof_now();
+			thumb_size = thumb_finish(e);
+			prof_file(PROF_FILE_PACK, e->name, t2);
+			if (thumb_size < 0) {
 				if (verbose)
-					fprintf(stderr, "Cannot generate thumbnail for %s\n",
-						dentry->d_name);
+					fprintf(stderr, "Generate thumbnail for %s failed\n",
+						e->name);
 				continue;
-			} else if (converter) {
-				int status;
-				waitpid(converter, &status, 0);
-				if (!WIFEXITED(status) || WEXITSTATUS(status) ||
-				    stat(thumb, &tstat) < 0) {
-					if (verbose)
-						fprintf(stderr,
-							"Generate thumbnail for %s failed\n",
-							dentry->d_name);
+			}
+
+			t2 = prof_now();
+			*obj = object_new(e->name, e->fstat.st_mtime, e->fstat.st_size,
+					  stat_protected(&e->fstat), format, thumb_size);
+			prof_file(PROF_FILE_INFO, e->name, t2);
+			if (!*obj) {
+				/* Names, which cannot be converted, are skipped */
+				if (errno != ENOMEM)
 					continue;
-				}
-			} else
-				execlp("convert", "convert", "-thumbnail", THUMB_SIZE,
-				       dentry->d_name, thumb, NULL);
+				ret = -1;
+				goto out;
+			}
+
+			handle = handle_assign(e->fstat.st_ino, e->name);
+			if (!handle) {
+				free(*obj);
+				*obj = NULL;
+				continue;
+			}
+
+			(*obj)->handle = handle;
+			(*obj)->thumb_hash = e->hash;
+
+			storage_account_add(e->fstat.st_size);
+
+			obj = &(*obj)->next;
+			*obj = NULL;
+			count++;
+			/* What the scan threads spent on it, plus the above */
+			prof_file(PROF_FILE_TOTAL, e->name, t1 - e->cost);
 		}
+		prof_phase(PROF_SCAN_OBJECTS, t0);
+	}
 
-		/* namelen and datelen include terminating '\0', plus 4 string-size bytes */
-		osize = sizeof(**obj) + 2 * (datelen + namelen) + 4;
+	t0 = prof_now();
+	pack_compact();
+	prof_phase(PROF_SCAN_COMPACT, t0);
 
-		if (verbose)
-			fprintf(stderr, "Listing image %s, modified %s, info-size %u\n",
-				dentry->d_name, mod, osize);
+	t0 = prof_now();
+	handles_prune();
+	handles_save();
+	sort_images(count);
+	prof_phase(PROF_SCAN_HANDLES, t0);
 
-		*obj = malloc(osize);
-		if (!*obj) {
-			ret = -1;
-			break;
+out:
+	/* Plus /DCIM and /DCIM/PTP_MODEL_DIR */
+	object_number = count + 2;
+
+	scan_pool_stop();
+	uring_exit(&ring);
+	free(batch);
+	free(list.shared);
+	free(list.name);
+	free(list.names);
+	return ret;
+}
+
+static int init_dirs(void)
+{
+	root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (root_fd < 0 || faccessat(root_fd, ".", R_OK | W_OK, 0) < 0) {
+		fprintf(stderr, "Invalid base directory %s\n", root);
+		return -1;
+	}
+
+	thumb_fd = open(THUMB_LOCATION, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (thumb_fd < 0)
+		fprintf(stderr, "Cannot open %s: %s, no thumbnails\n",
+			THUMB_LOCATION, strerror(errno));
+
+	return 0;
+}
+
+static int init_data_ring(void)
+{
+	static const __u8 data_ops[] = { IORING_OP_READ_FIXED };
+	struct iovec iov[URING_BUFS];
+	int i, ret;
+
+	ret = uring_init(&data_ring, URING_BUFS, data_ops, ARRAY_SIZE(data_ops));
+	if (ret < 0)
+		goto fail;
+
+	/* Owned by the ring for good */
+	for (i = 0; i < URING_BUFS; i++) {
+		uring_buf[i] = xfer_get();
+		if (!uring_buf[i]) {
+			ret = -ENOMEM;
+			goto free;
 		}
+		iov[i].iov_base = uring_buf[i];
+		iov[i].iov_len = sizeof(struct ptp_container) + URING_CHUNK;
+	}
 
-		(*obj)->handle = ++handle;
-
-		/* Fixed size object info, filename, capture date, and two empty strings */
-		(*obj)->info_size = sizeof((*obj)->info) + 2 * (datelen + namelen) + 4;
-
-		(*obj)->info.storage_id			= __cpu_to_le32(STORE_ID);
-		(*obj)->info.object_format		= __cpu_to_le16(format);
-		(*obj)->info.protection_status		= __cpu_to_le16(fstat.st_mode & S_IWUSR ? 0 : 1);
-		(*obj)->info.object_compressed_size	= __cpu_to_le32(fstat.st_size);
-		(*obj)->info.thumb_format		= __cpu_to_le16(PIMA15740_FMT_I_JFIF);
-		(*obj)->info.thumb_compressed_size	= __cpu_to_le32(tstat.st_size);
-		(*obj)->info.thumb_pix_width		= __cpu_to_le32(THUMB_WIDTH);
-		(*obj)->info.thumb_pix_height		= __cpu_to_le32(THUMB_HEIGHT);
-		(*obj)->info.image_pix_width		= __cpu_to_le32(0);	/* 0 == */
-		(*obj)->info.image_pix_height		= __cpu_to_le32(0);	/* not */
-		(*obj)->info.image_bit_depth		= __cpu_to_le32(0);	/* supported */
-		(*obj)->info.parent_object		= __cpu_to_le32(2);	/* Fixed /dcim/xxx/ */
-		(*obj)->info.association_type		= __cpu_to_le16(0);
-		(*obj)->info.association_desc		= __cpu_to_le32(0);
-		(*obj)->info.sequence_number		= __cpu_to_le32(0);
-		strncpy((*obj)->name, dentry->d_name, sizeof((*obj)->name));
-
-		(*obj)->info.strings[0]					= namelen;
-		memcpy((*obj)->info.strings + 1, fname_ucs2, namelen * 2);
-		/* We use file modification date as Capture Date */
-		(*obj)->info.strings[1 + namelen * 2]			= datelen;
-		memcpy((*obj)->info.strings + 2 + namelen * 2, mod_ucs2, datelen * 2);
-		/* Empty Modification Date */
-		(*obj)->info.strings[2 + (namelen + datelen) * 2]	= 0;
-		/* Empty Keywords */
-		(*obj)->info.strings[3 + (namelen + datelen) * 2]	= 0;
-
-		obj = &(*obj)->next;
-		*obj = NULL;
-	}
-
-	object_number = handle;
+	ret = uring_register_buffers(&data_ring, iov, URING_BUFS);
+	if (!ret)
+		return 0;
 
-	closedir(d);
+free:
+	for (i = 0; i < URING_BUFS; i++) {
+		xfer_put(uring_buf[i]);
+		uring_buf[i] = NULL;
+	}
+	uring_exit(&data_ring);
+fail:
+	if (verbose)
+		fprintf(stderr, "No io_uring for data: %s\n", strerror(-ret));
 	return ret;
 }
 
@@ -2347,8 +7804,16 @@ static void init_strings(iconv_t ic)
 {
 	put_string(ic, (char *)dev_info.manuf, manuf, sizeof(manuf));
 	put_string(ic, (char *)dev_info.model, model, sizeof(model));
+	put_string(ic, (char *)dev_info.vendor_ext_desc,
+		   vendor_ext_desc, sizeof(vendor_ext_desc));
+	dcim_name[0] = sizeof("DCIM");
+	put_string(ic, (char *)dcim_name + 1, "DCIM", sizeof("DCIM"));
+	model_dir_name[0] = sizeof(PTP_MODEL_DIR);
+	put_string(ic, (char *)model_dir_name + 1, PTP_MODEL_DIR, sizeof(PTP_MODEL_DIR));
 	put_string(ic, (char *)storage_info.desc,
 		   storage_desc, sizeof(storage_desc));
+	put_string(ic, (char *)ram_storage_info.desc,
+		   ram_storage_desc, sizeof(ram_storage_desc));
 }
 
 static void signothing(int sig, siginfo_t *info, void *ptr)
@@ -2366,7 +7831,7 @@ static int init_signal(void)
 	};
 
 	sigfillset(&sa.sa_mask);
-	/* We will use SIGINT to wake up the bulk thread from read() */
+	/* We will use SIGINT to kick the bulk thread out of read() / write() */
 	if (sigaction(SIGINT, &sa, NULL) < 0) {
 		perror("SIGINT");
 		return -1;
@@ -2376,30 +7841,54 @@ static int init_signal(void)
 
 int main(int argc, char *argv[])
 {
+	const char *replay_path = NULL;
+	uint64_t t0;
+	char *end;
 	int c, ret;
-	struct stat root_stat;
 
 	puts("Linux PTP Gadget v" VERSION_STRING);
 
-	ic = iconv_open("UCS-2LE", "ISO8859-1");
-	if (ic == (iconv_t)-1) {
-		perror("iconv_open");
-		return -1;
-	}
-
-	init_strings(ic);
-
 	if (init_signal() < 0)
 		exit(EXIT_FAILURE);
 
-	if (sem_init(&reset, 0, 0) < 0)
+	io_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	recv_data_ev = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	recv_space_ev = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (io_event < 0 || recv_data_ev < 0 || recv_space_ev < 0) {
+		perror("eventfd");
 		exit(EXIT_FAILURE);
+	}
 
-	while ((c = getopt(argc, argv, "v")) != EOF) {
+	while ((c = getopt(argc, argv, "vpUR:P:C:M:")) != EOF) {
 		switch (c) {
 		case 'v':
 			verbose++;
 			break;
+		case 'p':
+			profile = 1;
+			break;
+		case 'U':
+			use_uring = 0;
+			break;
+		case 'R':
+			if (record_open(optarg) < 0)
+				exit(EXIT_FAILURE);
+			break;
+		case 'P':
+			replay_path = optarg;
+			break;
+		case 'C':
+			capture_source = optarg;
+			break;
+		case 'M':
+			ram_store_budget = strtoull(optarg, &end, 0) << 20;
+			if (*end == ',')
+				ram_store_max = strtoul(end + 1, &end, 0);
+			if (*end || !ram_store_budget) {
+				fprintf(stderr, "Invalid RAM store limits %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		default:
 			fprintf(stderr, "Unsupported option %c\n", c);
 			exit(EXIT_FAILURE);
@@ -2408,22 +7897,74 @@ int main(int argc, char *argv[])
 
 	root = argv[argc - 1];
 
-	enum_objects(root);
+	t0 = prof_start = prof_now();
+	ic = iconv_open("UCS-2LE", "ISO8859-1");
+	if (ic == (iconv_t)-1) {
+		perror("iconv_open");
+		return -1;
+	}
 
-	if (chdir("/dev/gadget") < 0) {
-		perror("can't chdir /dev/gadget");
+	init_strings(ic);
+	prof_phase(PROF_ICONV, t0);
+
+	t0 = prof_now();
+	ret = init_dirs();
+	prof_phase(PROF_DIRS, t0);
+	if (ret < 0)
 		exit(EXIT_FAILURE);
+
+	t0 = prof_now();
+	pack_open();
+	prof_phase(PROF_PACK_OPEN, t0);
+	t0 = prof_now();
+	handles_load();
+	prof_phase(PROF_HANDLES_LOAD, t0);
+
+	t0 = prof_now();
+	enum_objects();
+	prof_phase(PROF_SCAN, t0);
+	t0 = prof_now();
+	pack_share();
+	prof_phase(PROF_PACK_SHARE, t0);
+
+	t0 = prof_now();
+	if (xfer_init() < 0)
+		exit(EXIT_FAILURE);
+	prof_phase(PROF_XFER, t0);
+
+	if (use_uring) {
+		t0 = prof_now();
+		init_data_ring();
+		prof_phase(PROF_DATA_RING, t0);
 	}
 
-	ret = stat(root, &root_stat);
-	if (ret < 0 || !S_ISDIR(root_stat.st_mode) || access(root, R_OK | W_OK) < 0) {
-		fprintf(stderr, "Invalid base directory %s\n", root);
+	t0 = prof_now();
+	if (init_delete_threads() < 0 || init_prefetch_thread() < 0)
+		exit(EXIT_FAILURE);
+	prof_phase(PROF_THREADS, t0);
+
+	t0 = prof_now();
+	if (init_storage() < 0)
+		exit(EXIT_FAILURE);
+	prof_phase(PROF_STORAGE, t0);
+
+	if (replay_path) {
+		if (profile)
+			prof_report(object_number);
+		exit(replay(replay_path) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	if (chdir("/dev/gadget") < 0) {
+		perror("can't chdir /dev/gadget");
 		exit(EXIT_FAILURE);
 	}
 
+	t0 = prof_now();
 	init_device();
+	prof_phase(PROF_DEVICE, t0);
 	if (control < 0)
 		exit(EXIT_FAILURE);
+	prof_config_start = prof_now();
 
 	fflush(stderr);
 
@@ -0,0 +1,292 @@
+/*
+ * Minimal io_uring wrapper on top of the raw system calls
+ *
+ * Copyright (C) 2026 The ptp-gadget contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "uring.h"
+
+#ifdef __NR_io_uring_setup
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned submit, unsigned complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned op, const void *arg, unsigned nr)
+{
+	return syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+/* Check that the kernel implements all opcodes, we are going to use */
+static int uring_probe(struct uring *ring, const __u8 *ops, unsigned ops_n)
+{
+	struct io_uring_probe *probe;
+	size_t size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	unsigned i;
+	int ret = 0;
+
+	probe = calloc(1, size);
+	if (!probe)
+		return -ENOMEM;
+
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+		/* No probing before 5.6, which also means no statx */
+		ret = -errno;
+		goto out;
+	}
+
+	for (i = 0; i < ops_n; i++)
+		if (ops[i] > probe->last_op ||
+		    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			ret = -EOPNOTSUPP;
+			break;
+		}
+
+out:
+	free(probe);
+	return ret;
+}
+
+int uring_init(struct uring *ring, unsigned entries, const __u8 *ops, unsigned ops_n)
+{
+	struct io_uring_params p;
+	void *sq, *cq;
+	int ret;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		return -errno;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	sq = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto err;
+	ring->sq_ring = sq;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	} else {
+		cq = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto err;
+	}
+	ring->cq_ring = cq;
+
+	ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto err;
+	}
+
+	ring->entries	= p.sq_entries;
+	ring->sq_head	= sq + p.sq_off.head;
+	ring->sq_tail	= sq + p.sq_off.tail;
+	ring->sq_mask	= sq + p.sq_off.ring_mask;
+	ring->sq_array	= sq + p.sq_off.array;
+	ring->cq_head	= cq + p.cq_off.head;
+	ring->cq_tail	= cq + p.cq_off.tail;
+	ring->cq_mask	= cq + p.cq_off.ring_mask;
+	ring->cqes	= cq + p.cq_off.cqes;
+
+	ret = uring_probe(ring, ops, ops_n);
+	if (ret < 0) {
+		uring_exit(ring);
+		return ret;
+	}
+
+	return 0;
+
+err:
+	ret = -errno;
+	uring_exit(ring);
+	return ret;
+}
+
+void uring_exit(struct uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, unsigned nr)
+{
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, nr) < 0)
+		return -errno;
+	return 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	unsigned tail = *ring->sq_tail + ring->queued;
+	unsigned idx;
+
+	if (ring->queued + ring->inflight >= ring->entries)
+		return NULL;
+
+	idx = tail & *ring->sq_mask;
+	ring->sq_array[idx] = idx;
+	ring->queued++;
+
+	memset(&ring->sqes[idx], 0, sizeof(ring->sqes[idx]));
+	return &ring->sqes[idx];
+}
+
+int uring_submit(struct uring *ring, unsigned wait_nr)
+{
+	unsigned submit = ring->queued;
+	int ret;
+
+	/* Publish the new tail only after the entries are filled in */
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+	ring->inflight += submit;
+	ring->queued = 0;
+
+	do {
+		ret = sys_io_uring_enter(ring->fd, submit, wait_nr,
+					 wait_nr ? IORING_ENTER_GETEVENTS : 0);
+		if (ret < 0) {
+			if (errno != EINTR)
+				return -errno;
+			continue;
+		}
+		if (!ret && submit)
+			return -EAGAIN;
+		submit -= ret;
+	} while (ret < 0 || submit);
+
+	return 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	unsigned head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+	ring->inflight--;
+}
+
+void uring_drain(struct uring *ring)
+{
+	while (ring->queued || ring->inflight) {
+		while (uring_peek_cqe(ring))
+			uring_cqe_seen(ring);
+		if ((ring->queued || ring->inflight) && uring_submit(ring, 1) < 0)
+			break;
+	}
+}
+
+#else /* !__NR_io_uring_setup */
+
+int uring_init(struct uring *ring, unsigned entries, const __u8 *ops, unsigned ops_n)
+{
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+	return -ENOSYS;
+}
+
+void uring_exit(struct uring *ring)
+{
+}
+
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, unsigned nr)
+{
+	return -ENOSYS;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	return NULL;
+}
+
+int uring_submit(struct uring *ring, unsigned wait_nr)
+{
+	return -ENOSYS;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	return NULL;
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+}
+
+void uring_drain(struct uring *ring)
+{
+}
+
+#endif
+
+void uring_prep_statx(struct io_uring_sqe *sqe, int dfd, const char *path,
+		      int flags, unsigned mask, struct statx *stx, __u64 data)
+{
+	sqe->opcode	= IORING_OP_STATX;
+	sqe->fd		= dfd;
+	sqe->addr	= (unsigned long)path;
+	sqe->len	= mask;
+	sqe->off	= (unsigned long)stx;
+	sqe->statx_flags = flags;
+	sqe->user_data	= data;
+}
+
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf,
+			   unsigned len, __u64 offset, int index, __u64 data)
+{
+	sqe->opcode	= IORING_OP_READ_FIXED;
+	sqe->fd		= fd;
+	sqe->addr	= (unsigned long)buf;
+	sqe->len	= len;
+	sqe->off	= offset;
+	sqe->buf_index	= index;
+	sqe->user_data	= data;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2026 The ptp-gadget contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ */
+
+/* minimal io_uring wrapper on top of the raw system calls */
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+struct statx;
+struct iovec;
+
+/**
+ * struct uring - a submission / completion queue pair
+ * @fd: the ring file descriptor, negative if the ring is not set up
+ * @entries: number of submission queue entries
+ * @queued: entries, prepared but not yet submitted to the kernel
+ * @inflight: entries, submitted but not yet completed
+ *
+ * A ring must only be used by one thread at a time.
+ */
+struct uring {
+	int			fd;
+	unsigned		entries;
+	unsigned		queued;
+	unsigned		inflight;
+
+	unsigned		*sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned		*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+
+	void			*sq_ring, *cq_ring;
+	size_t			sq_ring_size, cq_ring_size;
+};
+
+/* set up a ring, returns -errno if io_uring or any of @ops is unsupported */
+int uring_init(struct uring *ring, unsigned entries, const __u8 *ops, unsigned ops_n);
+void uring_exit(struct uring *ring);
+
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, unsigned nr);
+
+/* next free submission entry or NULL if the queue is full */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/* submit queued entries and wait for at least @wait_nr completions */
+int uring_submit(struct uring *ring, unsigned wait_nr);
+
+/* next completion or NULL, call uring_cqe_seen() when done with it */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+/* wait for and discard all outstanding completions */
+void uring_drain(struct uring *ring);
+
+void uring_prep_statx(struct io_uring_sqe *sqe, int dfd, const char *path,
+		      int flags, unsigned mask, struct statx *stx, __u64 data);
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf,
+			   unsigned len, __u64 offset, int index, __u64 data);
+
+#endif /* URING_H */